@@ -0,0 +1,273 @@
+// Micro benchmarks of the parsers, add_entry, checkpoints and exports, and end-to-end throughput of
+// handle_all, all on input from traffic.h. Parser and handle_all benchmarks taking a mode argument run the
+// scanner with 0 and the std::regex reference with 1. Built by CMake as nod_bench when Google Benchmark is found,
+// or by hand:
+//   g++ -std=c++17 -O2 -pthread bench/nod_bench.cc engine.cc -lbenchmark -o nod_bench
+#define NOD_NO_MAIN
+#include "../nod.cc"
+
+#include <benchmark/benchmark.h>
+
+#include <cstdio>
+#include <map>
+
+#include "traffic.h"
+
+namespace {
+    namespace bench {
+        // Generated once, the views of all samples point into it.
+        const std::string &sample_input() {
+            static const std::string input = [] {
+                traffic::settings_t settings;
+                settings.lines = 200000;
+                settings.vehicles = 20000;
+                settings.command_ratio = 0.05;
+                return traffic::generator_t(settings).generate();
+            }();
+            return input;
+        }
+
+        std::vector<std::string_view> sample_lines() {
+            std::vector<std::string_view> lines;
+            std::string_view rest = sample_input();
+            while (!rest.empty()) {
+                auto end = rest.find('\n');
+                lines.push_back(rest.substr(0, end));
+                rest.remove_prefix(std::min(end + 1, rest.size()));
+            }
+            return lines;
+        }
+
+        // Word number word_index of every info line, and the arguments of all commands.
+        const std::vector<std::string_view> &sample_words(size_t word_index) {
+            static std::map<size_t, std::vector<std::string_view>> samples;
+            auto &words = samples[word_index];
+            if (words.empty())
+                for (auto line : sample_lines()) {
+                    if (input::is_command_line(line))
+                        continue;
+                    auto args = input::split_args(line);
+                    if (word_index < args.size())
+                        words.push_back(args[word_index]);
+                }
+            return words;
+        }
+
+        const std::vector<std::string_view> &sample_commands() {
+            static const std::vector<std::string_view> commands = [] {
+                std::vector<std::string_view> result;
+                for (auto line : sample_lines())
+                    if (input::is_command_line(line))
+                        result.push_back(line);
+                return result;
+            }();
+            return commands;
+        }
+
+        using sample_record_t = std::tuple<input::info_desc_t, input::line_desc_ref_t>;
+
+        const std::vector<sample_record_t> &sample_records() {
+            static const std::vector<sample_record_t> records = [] {
+                std::vector<sample_record_t> result;
+                input::line_no_t line_no = 0;
+                for (auto line : sample_lines()) {
+                    line_no++;
+                    auto info = input::parse_info(line);
+                    if (info)
+                        result.emplace_back(info.value(), input::line_desc_ref_t(line_no, line));
+                }
+                return result;
+            }();
+            return records;
+        }
+
+        // Runs parse on every sample, processed bytes are the bytes of the samples.
+        template<typename Parse>
+        void run_parser(benchmark::State &state, const std::vector<std::string_view> &samples, Parse &&parse) {
+            options::regex_reference = state.range(0);
+            size_t bytes = 0;
+            for (auto sample : samples)
+                bytes += sample.size();
+            for (auto _ : state)
+                for (auto sample : samples)
+                    benchmark::DoNotOptimize(parse(sample));
+            options::regex_reference = false;
+            state.SetItemsProcessed(state.iterations() * samples.size());
+            state.SetBytesProcessed(state.iterations() * bytes);
+        }
+
+        void parse_vehicle(benchmark::State &state) {
+            run_parser(state, sample_words(0), vehicle::parse_vehicle);
+        }
+
+        void parse_road(benchmark::State &state) {
+            run_parser(state, sample_words(1), road::parse_road);
+        }
+
+        void parse_distance(benchmark::State &state) {
+            run_parser(state, sample_words(2), road::parse_distance);
+        }
+
+        void parse_command(benchmark::State &state) {
+            run_parser(state, sample_commands(), input::parse_command);
+        }
+
+        void parse_info(benchmark::State &state) {
+            run_parser(state, sample_lines(), input::parse_info);
+        }
+
+        // Applies all info lines of the sample to an empty state.
+        void add_entry(benchmark::State &state) {
+            const auto &records = sample_records();
+            for (auto _ : state) {
+                toll_charging::state_t toll_state;
+                for (const auto &[info, line_desc] : records) {
+                    const auto &[vehicle, road, distance] = info;
+                    benchmark::DoNotOptimize(toll_charging::add_entry(toll_state, vehicle, road, distance, line_desc));
+                }
+            }
+            state.SetItemsProcessed(state.iterations() * records.size());
+        }
+
+        // State after all info lines of the sample.
+        toll_charging::state_t sample_state() {
+            toll_charging::state_t toll_state;
+            for (const auto &[info, line_desc] : sample_records()) {
+                const auto &[vehicle, road, distance] = info;
+                toll_charging::add_entry(toll_state, vehicle, road, distance, line_desc);
+            }
+            return toll_state;
+        }
+
+        // Saves the state after all info lines of the sample and restores it again.
+        void checkpoint_round_trip(benchmark::State &state) {
+            auto toll_state = sample_state();
+            char path[] = "/tmp/nod_bench_XXXXXX";
+            close(mkstemp(path));
+            for (auto _ : state) {
+                toll_charging::state_t restored;
+                input::line_no_t line_no = 0;
+                if (!checkpoint::save(toll_state, 0, path) || !checkpoint::restore(restored, line_no, path))
+                    state.SkipWithError("checkpoint failed");
+            }
+            unlink(path);
+        }
+
+        // Writes the totals of the sample state to a file, as the columnar export with 0 and as the answer
+        // to "?" with 1.
+        void export_totals(benchmark::State &state) {
+            auto toll_state = sample_state();
+            char path[] = "/tmp/nod_bench_XXXXXX";
+            close(mkstemp(path));
+            for (auto _ : state) {
+                if (state.range(0) == 0) {
+                    if (!columns::save(toll_state, path))
+                        state.SkipWithError("export failed");
+                    continue;
+                }
+                std::string dump;
+                output::captured = &dump;
+                input::handle_command(toll_state, input::command_desc_t());
+                output::captured = nullptr;
+                if (!output::write_file(path, dump))
+                    state.SkipWithError("export failed");
+            }
+            unlink(path);
+        }
+
+        // Generated input in a temporary file, read through stdin while stdout and stderr go to /dev/null.
+        class redirected_input_t {
+        public:
+            redirected_input_t() {
+                traffic::settings_t settings;
+                input = traffic::generator_t(settings).generate();
+                lines = std::count(input.begin(), input.end(), '\n');
+                char path[] = "/tmp/nod_bench_XXXXXX";
+                int fd = mkstemp(path);
+                output::write_all(fd, input);
+                unlink(path);
+                input_fd = fd;
+                null_fd = open("/dev/null", O_WRONLY);
+                for (int stream : {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO})
+                    saved_fds.push_back(dup(stream));
+            }
+
+            ~redirected_input_t() {
+                close(input_fd);
+                close(null_fd);
+                for (int fd : saved_fds)
+                    close(fd);
+            }
+
+            // Runs handle with the file as stdin from its start.
+            template<typename Handler>
+            void run(Handler &&handle) {
+                lseek(input_fd, 0, SEEK_SET);
+                std::fflush(stdout);
+                dup2(input_fd, STDIN_FILENO);
+                dup2(null_fd, STDOUT_FILENO);
+                dup2(null_fd, STDERR_FILENO);
+                handle();
+                output::flush();
+                for (int stream : {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO})
+                    dup2(saved_fds[stream], stream);
+            }
+
+            std::string input;
+            size_t lines = 0;
+
+        private:
+            int input_fd = -1, null_fd = -1;
+            std::vector<int> saved_fds;
+        };
+
+        redirected_input_t &redirected_input() {
+            static redirected_input_t redirected;
+            return redirected;
+        }
+
+        void set_throughput(benchmark::State &state, const redirected_input_t &redirected) {
+            state.SetItemsProcessed(state.iterations() * redirected.lines);
+            state.SetBytesProcessed(state.iterations() * redirected.input.size());
+            state.counters["lines/s"] = benchmark::Counter(double(state.iterations() * redirected.lines),
+                                                           benchmark::Counter::kIsRate);
+        }
+
+        void handle_all(benchmark::State &state) {
+            auto &redirected = redirected_input();
+            options::regex_reference = state.range(0);
+            for (auto _ : state)
+                redirected.run([] {
+                    toll_charging::state_t toll_state;
+                    input::line_no_t line_no = 0;
+                    input::handle_all(toll_state, line_no);
+                    const auto &mapped_input = toll_state.mapped_input;
+                    if (!mapped_input.empty())
+                        munmap(const_cast<char *>(mapped_input.data()), mapped_input.size());
+                });
+            options::regex_reference = false;
+            set_throughput(state, redirected);
+        }
+
+        void handle_all_threads(benchmark::State &state) {
+            auto &redirected = redirected_input();
+            size_t threads = state.range(0);
+            for (auto _ : state)
+                redirected.run([threads] { pipeline::handle_all(threads); });
+            set_throughput(state, redirected);
+        }
+    }
+}
+
+BENCHMARK(bench::parse_vehicle)->Arg(0)->Arg(1);
+BENCHMARK(bench::parse_road)->Arg(0)->Arg(1);
+BENCHMARK(bench::parse_distance)->Arg(0)->Arg(1);
+BENCHMARK(bench::parse_command)->Arg(0)->Arg(1);
+BENCHMARK(bench::parse_info)->Arg(0)->Arg(1);
+BENCHMARK(bench::add_entry)->Unit(benchmark::kMillisecond);
+BENCHMARK(bench::checkpoint_round_trip)->Unit(benchmark::kMillisecond);
+BENCHMARK(bench::export_totals)->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond);
+BENCHMARK(bench::handle_all)->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(bench::handle_all_threads)->Arg(2)->Arg(4)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+BENCHMARK_MAIN();
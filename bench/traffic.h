@@ -0,0 +1,185 @@
+#ifndef NOD_BENCH_TRAFFIC_H
+#define NOD_BENCH_TRAFFIC_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <random>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+
+// Synthetic gantry traffic in the input format of nod.cc. The same seed and settings always give the same
+// input, so runs can be compared with each other.
+namespace traffic {
+    struct settings_t {
+        uint64_t seed = 1;
+        size_t lines = 1000000;
+        size_t vehicles = 100000;
+        // Number of distinct roads, and the Zipf exponent of how often each of them is used.
+        size_t roads = 200;
+        double road_skew = 1.0;
+        // Fractions of all lines.
+        double command_ratio = 0.001;
+        double malformed_ratio = 0.01;
+        double empty_ratio = 0.001;
+        // Fraction of entries that are followed by another entry instead of an exit, leaving them unpaired.
+        double unpaired_ratio = 0.02;
+        // Fraction of commands without an argument, which print the whole state.
+        double full_report_ratio = 0.01;
+    };
+
+    class generator_t {
+    public:
+        explicit generator_t(const settings_t &settings) : settings(settings), random(settings.seed) {
+            std::unordered_set<std::string> seen;
+            std::uniform_int_distribution<size_t> length(3, 11);
+            while (plates.size() < settings.vehicles) {
+                std::string plate = word(length(random));
+                if (seen.insert(plate).second)
+                    plates.push_back(plate);
+            }
+            trips.resize(settings.vehicles);
+
+            std::vector<std::string> all_roads;
+            for (int num = 1; num <= 999; num++) {
+                all_roads.push_back("A" + std::to_string(num));
+                all_roads.push_back("S" + std::to_string(num));
+            }
+            std::shuffle(all_roads.begin(), all_roads.end(), random);
+            all_roads.resize(std::min(std::max<size_t>(settings.roads, 1), all_roads.size()));
+            roads = all_roads;
+            std::vector<double> weights;
+            for (size_t rank = 1; rank <= roads.size(); rank++)
+                weights.push_back(1.0 / std::pow(double(rank), settings.road_skew));
+            road_choice = std::discrete_distribution<size_t>(weights.begin(), weights.end());
+        }
+
+        // Appends the next line, including its '\n'.
+        void next_line(std::string &out) {
+            double kind = unit(random);
+            if (kind < settings.command_ratio)
+                command(out);
+            else if ((kind -= settings.command_ratio) < settings.malformed_ratio)
+                malformed(out);
+            else if ((kind -= settings.malformed_ratio) < settings.empty_ratio)
+                ;
+            else
+                info(out);
+            out += '\n';
+        }
+
+        std::string generate() {
+            std::string out;
+            for (size_t line = 0; line < settings.lines; line++)
+                next_line(out);
+            return out;
+        }
+
+    private:
+        // Road index and kilometre count of the junction where the vehicle entered, if it is on a road.
+        struct trip_t {
+            bool on_road = false;
+            size_t road = 0;
+            int distance = 0;
+        };
+
+        static constexpr std::string_view alnum = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789";
+
+        std::string word(size_t length) {
+            std::uniform_int_distribution<size_t> letter(0, alnum.size() - 1);
+            std::string result;
+            for (size_t i = 0; i < length; i++)
+                result += alnum[letter(random)];
+            return result;
+        }
+
+        std::string space() {
+            double kind = unit(random);
+            return kind < 0.9 ? " " : kind < 0.95 ? "  " : "\t";
+        }
+
+        static std::string distance_str(int distance) {
+            return std::to_string(distance / 10) + "," + std::to_string(distance % 10);
+        }
+
+        void entry(std::string &out, const std::string &plate, const std::string &road, int distance) {
+            if (unit(random) < 0.01)
+                out += space();
+            out += plate + space() + road + space() + distance_str(distance);
+            if (unit(random) < 0.01)
+                out += space();
+        }
+
+        void info(std::string &out) {
+            size_t vehicle = std::uniform_int_distribution<size_t>(0, plates.size() - 1)(random);
+            auto &trip = trips[vehicle];
+            if (trip.on_road && unit(random) >= settings.unpaired_ratio) {
+                int length = std::uniform_int_distribution<int>(1, 3000)(random);
+                int distance = unit(random) < 0.5 || trip.distance < length ? trip.distance + length
+                                                                             : trip.distance - length;
+                entry(out, plates[vehicle], roads[trip.road], distance);
+                trip.on_road = false;
+                return;
+            }
+            trip.on_road = true;
+            trip.road = road_choice(random);
+            trip.distance = std::uniform_int_distribution<int>(0, 20000)(random);
+            entry(out, plates[vehicle], roads[trip.road], trip.distance);
+        }
+
+        void command(std::string &out) {
+            double kind = unit(random);
+            out += '?';
+            if (kind < settings.full_report_ratio)
+                return;
+            if (kind < (1 + settings.full_report_ratio) / 2)
+                out += roads[road_choice(random)];
+            else
+                out += space() + plates[std::uniform_int_distribution<size_t>(0, plates.size() - 1)(random)];
+        }
+
+        // Lines that break one rule of the grammar each.
+        void malformed(std::string &out) {
+            const auto &plate = plates[std::uniform_int_distribution<size_t>(0, plates.size() - 1)(random)];
+            const auto &road = roads[road_choice(random)];
+            switch (std::uniform_int_distribution<int>(0, 7)(random)) {
+                case 0:
+                    out += word(12) + " " + road + " 1,0";
+                    break;
+                case 1:
+                    out += plate + " " + road.substr(0, 1) + "0" + road.substr(1) + " 1,0";
+                    break;
+                case 2:
+                    out += plate + " " + road + " 12";
+                    break;
+                case 3:
+                    out += plate + " " + road + " 01,5";
+                    break;
+                case 4:
+                    out += plate + " " + road + " 1,0 extra";
+                    break;
+                case 5:
+                    out += plate + " B" + road.substr(1) + " 1,0";
+                    break;
+                case 6:
+                    out += "? " + plate + " " + road;
+                    break;
+                default:
+                    out += plate + "-" + " " + road;
+                    break;
+            }
+        }
+
+        settings_t settings;
+        std::mt19937_64 random;
+        std::uniform_real_distribution<double> unit{0.0, 1.0};
+        std::vector<std::string> plates;
+        std::vector<trip_t> trips;
+        std::vector<std::string> roads;
+        std::discrete_distribution<size_t> road_choice;
+    };
+}
+
+#endif
@@ -0,0 +1,56 @@
+// Writes synthetic input for nod.cc to stdout:
+//   traffic_gen [--seed N] [--lines N] [--vehicles N] [--roads N] [--road-skew X] [--commands X]
+//               [--malformed X] [--empty X] [--unpaired X] [--full-reports X]
+// Ratios are fractions, see traffic::settings_t.
+#include <cstdio>
+#include <cstdlib>
+#include <string_view>
+
+#include "traffic.h"
+
+int main(int argc, char *argv[]) {
+    traffic::settings_t settings;
+    for (int i = 1; i < argc; i++) {
+        std::string_view arg(argv[i]);
+        if (i + 1 == argc) {
+            std::fprintf(stderr, "Missing value for: %s\n", argv[i]);
+            return 1;
+        }
+        const char *value = argv[++i];
+        if (arg == "--seed")
+            settings.seed = std::strtoull(value, nullptr, 10);
+        else if (arg == "--lines")
+            settings.lines = std::strtoull(value, nullptr, 10);
+        else if (arg == "--vehicles" && std::strtoull(value, nullptr, 10) > 0)
+            settings.vehicles = std::strtoull(value, nullptr, 10);
+        else if (arg == "--roads")
+            settings.roads = std::strtoull(value, nullptr, 10);
+        else if (arg == "--road-skew")
+            settings.road_skew = std::atof(value);
+        else if (arg == "--commands")
+            settings.command_ratio = std::atof(value);
+        else if (arg == "--malformed")
+            settings.malformed_ratio = std::atof(value);
+        else if (arg == "--empty")
+            settings.empty_ratio = std::atof(value);
+        else if (arg == "--unpaired")
+            settings.unpaired_ratio = std::atof(value);
+        else if (arg == "--full-reports")
+            settings.full_report_ratio = std::atof(value);
+        else {
+            std::fprintf(stderr, "Unknown option: %s\n", argv[i - 1]);
+            return 1;
+        }
+    }
+
+    traffic::generator_t generator(settings);
+    std::string out;
+    for (size_t line = 0; line < settings.lines; line++) {
+        generator.next_line(out);
+        if (out.size() >= 1 << 20 || line + 1 == settings.lines) {
+            std::fwrite(out.data(), 1, out.size(), stdout);
+            out.clear();
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,51 @@
+# Runs BINARY on synthetic traffic the way MODE selects, and fails unless it prints the same stdout and stderr as
+# the plain run from a mapped file. Called by the tests of CMakeLists.txt with GENERATOR, BINARY, LINES, SEED, MODE
+# and WORK_DIR. MODE is regex_reference, pipe, threads or checkpoint, the last splitting the input in two runs
+# joined by --checkpoint and --restore.
+file(MAKE_DIRECTORY ${WORK_DIR})
+set(traffic ${WORK_DIR}/traffic.txt)
+execute_process(COMMAND ${GENERATOR} --seed ${SEED} --lines ${LINES} OUTPUT_FILE ${traffic} COMMAND_ERROR_IS_FATAL ANY)
+execute_process(COMMAND ${BINARY} INPUT_FILE ${traffic} OUTPUT_FILE ${WORK_DIR}/expected.out
+                ERROR_FILE ${WORK_DIR}/expected.err COMMAND_ERROR_IS_FATAL ANY)
+
+set(actual ${WORK_DIR}/actual)
+if(MODE STREQUAL "regex_reference")
+    execute_process(COMMAND ${BINARY} --regex-reference INPUT_FILE ${traffic} OUTPUT_FILE ${actual}.out
+                    ERROR_FILE ${actual}.err COMMAND_ERROR_IS_FATAL ANY)
+elseif(MODE STREQUAL "pipe")
+    execute_process(COMMAND ${CMAKE_COMMAND} -E cat ${traffic} COMMAND ${BINARY} OUTPUT_FILE ${actual}.out
+                    ERROR_FILE ${actual}.err COMMAND_ERROR_IS_FATAL ANY)
+elseif(MODE STREQUAL "threads")
+    execute_process(COMMAND ${BINARY} --threads 4 INPUT_FILE ${traffic} OUTPUT_FILE ${actual}.out
+                    ERROR_FILE ${actual}.err COMMAND_ERROR_IS_FATAL ANY)
+elseif(MODE STREQUAL "checkpoint")
+    file(READ ${traffic} content)
+    string(LENGTH "${content}" length)
+    math(EXPR middle "${length} / 2")
+    string(SUBSTRING "${content}" ${middle} -1 rest)
+    string(FIND "${rest}" "\n" newline)
+    math(EXPR split "${middle} + ${newline} + 1")
+    string(SUBSTRING "${content}" 0 ${split} first)
+    string(SUBSTRING "${content}" ${split} -1 second)
+    file(WRITE ${WORK_DIR}/first.txt "${first}")
+    file(WRITE ${WORK_DIR}/second.txt "${second}")
+    execute_process(COMMAND ${BINARY} --checkpoint ${WORK_DIR}/checkpoint.bin INPUT_FILE ${WORK_DIR}/first.txt
+                    OUTPUT_FILE ${actual}1.out ERROR_FILE ${actual}1.err COMMAND_ERROR_IS_FATAL ANY)
+    execute_process(COMMAND ${BINARY} --restore ${WORK_DIR}/checkpoint.bin INPUT_FILE ${WORK_DIR}/second.txt
+                    OUTPUT_FILE ${actual}2.out ERROR_FILE ${actual}2.err COMMAND_ERROR_IS_FATAL ANY)
+    foreach(stream out err)
+        file(READ ${actual}1.${stream} part1)
+        file(READ ${actual}2.${stream} part2)
+        file(WRITE ${actual}.${stream} "${part1}${part2}")
+    endforeach()
+else()
+    message(FATAL_ERROR "Unknown mode: ${MODE}")
+endif()
+
+foreach(stream out err)
+    execute_process(COMMAND ${CMAKE_COMMAND} -E compare_files ${WORK_DIR}/expected.${stream} ${actual}.${stream}
+                    RESULT_VARIABLE different)
+    if(different)
+        message(FATAL_ERROR "${MODE}: std${stream} differs from the plain run, see ${WORK_DIR}")
+    endif()
+endforeach()
@@ -0,0 +1,9 @@
+# Records nod_perf with frame pointer call graphs on synthetic traffic, into WORK_DIR/perf.data. Called by the
+# perf_record target with GENERATOR, BINARY, LINES, SEED, PERF and WORK_DIR. The traffic file is kept, so the
+# same input can be replayed by hand against other builds.
+file(MAKE_DIRECTORY ${WORK_DIR})
+set(traffic ${WORK_DIR}/traffic.txt)
+execute_process(COMMAND ${GENERATOR} --seed ${SEED} --lines ${LINES} OUTPUT_FILE ${traffic} COMMAND_ERROR_IS_FATAL ANY)
+execute_process(COMMAND ${PERF} record --call-graph fp -o ${WORK_DIR}/perf.data ${BINARY} INPUT_FILE ${traffic}
+                OUTPUT_FILE /dev/null ERROR_FILE ${WORK_DIR}/perf.err COMMAND_ERROR_IS_FATAL ANY)
+message(STATUS "Recorded ${WORK_DIR}/perf.data, see perf report -i ${WORK_DIR}/perf.data")
@@ -0,0 +1,34 @@
+# Runs the instrumented nod on synthetic traffic, from a file, from a pipe and with worker threads, and leaves
+# the profile at PROFILE. Called by the pgo_train target with GENERATOR, INSTRUMENTED, LINES, SEED, WORK_DIR,
+# RAW (the GCC .gcda file of nod.cc or the Clang .profraw directory), PROFILE and, for Clang, PROFDATA. With GCC,
+# ENGINE_RAW and ENGINE_PROFILE are the .gcda files of engine.cc.
+file(MAKE_DIRECTORY ${WORK_DIR})
+file(REMOVE_RECURSE ${RAW} ${ENGINE_RAW})
+set(traffic ${WORK_DIR}/traffic.txt)
+execute_process(COMMAND ${GENERATOR} --seed ${SEED} --lines ${LINES} OUTPUT_FILE ${traffic} COMMAND_ERROR_IS_FATAL ANY)
+
+foreach(run "file" "pipe" "threads")
+    if(run STREQUAL "pipe")
+        execute_process(COMMAND ${CMAKE_COMMAND} -E cat ${traffic} COMMAND ${INSTRUMENTED}
+                        OUTPUT_FILE /dev/null ERROR_FILE ${WORK_DIR}/${run}.err RESULT_VARIABLE result)
+    else()
+        set(args "")
+        if(run STREQUAL "threads")
+            set(args --threads 4)
+        endif()
+        execute_process(COMMAND ${INSTRUMENTED} ${args} INPUT_FILE ${traffic}
+                        OUTPUT_FILE /dev/null ERROR_FILE ${WORK_DIR}/${run}.err RESULT_VARIABLE result)
+    endif()
+    if(NOT result EQUAL 0)
+        message(FATAL_ERROR "Training run ${run} failed: ${result}")
+    endif()
+endforeach()
+
+if(PROFDATA)
+    file(GLOB raw_profiles ${RAW}/*.profraw)
+    execute_process(COMMAND ${PROFDATA} merge -output=${PROFILE} ${raw_profiles} COMMAND_ERROR_IS_FATAL ANY)
+else()
+    file(COPY_FILE ${RAW} ${PROFILE})
+    file(COPY_FILE ${ENGINE_RAW} ${ENGINE_PROFILE})
+endif()
+file(REMOVE ${traffic})
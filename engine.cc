@@ -0,0 +1,313 @@
+// The out-of-line part of engine.h, linked into nod and into the nod_engine library.
+#include "engine.h"
+
+#include <cstdlib>
+
+namespace nod::detail {
+    namespace vehicle {
+        namespace {
+            uint32_t plate_tag(const plate_no_t &plate_no) {
+                return uint32_t(plate_no_hash()(plate_no) >> 32);
+            }
+
+            // Fibonacci hashing; the multiplication mixes all bits of the tag into the upper ones.
+            size_t home_slot(const plates_index_t &index, uint32_t tag) {
+                return uint32_t(tag * 2654435769u) >> (32 - __builtin_ctzll(index.size()));
+            }
+
+            size_t probe_distance(const plates_index_t &index, size_t slot, uint32_t tag) {
+                return (slot - home_slot(index, tag)) & (index.size() - 1);
+            }
+
+            std::optional<vehicle_id_t> lookup(const intern_table_t &table, const plate_no_t &plate_no,
+                                               uint32_t tag) {
+                const auto &[index, plates] = table;
+                if (index.empty())
+                    return std::nullopt;
+                for (size_t slot = home_slot(index, tag), distance = 0;; slot = (slot + 1) & (index.size() - 1)) {
+                    const auto &[slot_tag, id] = index[slot];
+                    if (id == no_id || probe_distance(index, slot, slot_tag) < distance)
+                        return std::nullopt;
+                    if (slot_tag == tag && plates[id] == plate_no)
+                        return id;
+                    distance++;
+                }
+            }
+
+            void insert_slot(plates_index_t &index, uint32_t tag, vehicle_id_t id) {
+                for (size_t slot = home_slot(index, tag), distance = 0;; slot = (slot + 1) & (index.size() - 1)) {
+                    auto &[slot_tag, slot_id] = index[slot];
+                    if (slot_id == no_id) {
+                        slot_tag = tag;
+                        slot_id = id;
+                        return;
+                    }
+                    auto slot_distance = probe_distance(index, slot, slot_tag);
+                    if (slot_distance < distance) {
+                        std::swap(slot_tag, tag);
+                        std::swap(slot_id, id);
+                        distance = slot_distance;
+                    }
+                    distance++;
+                }
+            }
+
+            // Keeps the load factor of the index at most 7/8 after one more plate number is added.
+            void reserve_index(intern_table_t &table) {
+                auto &[index, plates] = table;
+                if ((plates.size() + 1) * 8 <= index.size() * 7)
+                    return;
+                plates_index_t grown(std::max(initial_index_size, index.size() * 2), plate_slot_t(0, no_id));
+                for (const auto &[tag, id] : index)
+                    if (id != no_id)
+                        insert_slot(grown, tag, id);
+                index.swap(grown);
+            }
+        }
+
+        vehicle_id_t intern(intern_table_t &table, const vehicle_ref_t &vehicle) {
+            auto plate_no = to_plate_no(vehicle);
+            auto tag = plate_tag(plate_no);
+            if (auto id = lookup(table, plate_no, tag))
+                return id.value();
+            reserve_index(table);
+            auto &[index, plates] = table;
+            auto id = vehicle_id_t(plates.size());
+            plates.push_back(plate_no);
+            insert_slot(index, tag, id);
+            return id;
+        }
+
+        std::optional<vehicle_id_t> find_id(const intern_table_t &table, const vehicle_ref_t &vehicle) {
+            auto plate_no = to_plate_no(vehicle);
+            return lookup(table, plate_no, plate_tag(plate_no));
+        }
+    }
+
+    namespace input {
+        namespace {
+            bool is_mapped(std::string_view mapped_input, std::string_view line) {
+                auto mapped_end = mapped_input.data() + mapped_input.size();
+                return !mapped_input.empty() && line.data() >= mapped_input.data()
+                       && line.data() + line.size() <= mapped_end;
+            }
+        }
+    }
+
+    namespace toll_charging {
+        namespace {
+            void release_source(state_t &state, const stored_source_t &source) {
+                auto stored_line = std::get_if<input::stored_line_t>(&source);
+                if (stored_line && std::get<input::line_source_t>(*stored_line) == input::line_source_t::arena)
+                    state.line_arena.live -= std::get<uint32_t>(std::get<input::input_slice_t>(*stored_line));
+            }
+
+            void add_window_distance(road_window_t &window, const road::road_t &road,
+                                     road::total_distance_t distance) {
+                auto &[buckets, epoch] = window;
+                if (buckets.empty())
+                    buckets.resize(max_window);
+                add_road_distance(buckets[epoch % max_window], road, distance);
+            }
+
+            bool ranks_before(const state_t &state, size_t type, vehicle::vehicle_id_t lhs,
+                              vehicle::vehicle_id_t rhs) {
+                const auto &vehicles_data = state.vehicles_data;
+                const auto &table = state.table;
+                return toll_charging::ranks_before(std::get<0>(vehicles_data[lhs])[type], vehicle::plate_no(table, lhs),
+                                                   std::get<0>(vehicles_data[rhs])[type],
+                                                   vehicle::plate_no(table, rhs));
+            }
+
+            // Moves the heap slot at position towards the leaves until no child ranks below it.
+            void sift_down(const state_t &state, size_t type, top_heap_t &top_heap, size_t position) {
+                auto &[heap, positions] = top_heap;
+                while (true) {
+                    auto lowest = position;
+                    for (auto child : {2 * position + 1, 2 * position + 2})
+                        if (child < heap.size() && ranks_before(state, type, heap[lowest], heap[child]))
+                            lowest = child;
+                    if (lowest == position)
+                        return;
+                    std::swap(heap[position], heap[lowest]);
+                    positions[heap[position]] = uint32_t(position);
+                    positions[heap[lowest]] = uint32_t(lowest);
+                    position = lowest;
+                }
+            }
+
+            void sift_up(const state_t &state, size_t type, top_heap_t &top_heap, size_t position) {
+                auto &[heap, positions] = top_heap;
+                while (position > 0 && ranks_before(state, type, heap[(position - 1) / 2], heap[position])) {
+                    auto parent = (position - 1) / 2;
+                    std::swap(heap[position], heap[parent]);
+                    positions[heap[position]] = uint32_t(position);
+                    positions[heap[parent]] = uint32_t(parent);
+                    position = parent;
+                }
+            }
+
+            size_t home_slot(const std::vector<not_finished_slot_t> &slots, vehicle::vehicle_id_t id) {
+                return size_t((uint64_t(id) * 0x9e3779b97f4a7c15ULL) >> 32) & (slots.size() - 1);
+            }
+
+            void erase_slot(not_finished_data_t &not_finished, size_t index) {
+                auto &[slots, used] = not_finished;
+                auto mask = slots.size() - 1;
+                for (auto next = (index + 1) & mask; std::get<vehicle::vehicle_id_t>(slots[next]) != no_vehicle;
+                     next = (next + 1) & mask) {
+                    auto home = home_slot(slots, std::get<vehicle::vehicle_id_t>(slots[next]));
+                    // The entry at next may fill the hole only if its home slot is not in (index, next].
+                    if (((next - home) & mask) >= ((next - index) & mask)) {
+                        slots[index] = std::move(slots[next]);
+                        index = next;
+                    }
+                }
+                slots[index] = not_finished_slot_t(no_vehicle, not_finished_entry_t());
+                used--;
+            }
+
+            // Moves the lines still referenced to the front of the arena, once most of it is garbage.
+            void compact_lines(state_t &state) {
+                auto &[bytes, spare, live] = state.line_arena;
+                if (bytes.size() < min_compacted_arena || bytes.size() < 2 * live)
+                    return;
+                spare.clear();
+                for (auto &[id, entry] : std::get<std::vector<not_finished_slot_t>>(state.not_finished)) {
+                    auto stored_line = std::get_if<input::stored_line_t>(&std::get<stored_source_t>(entry));
+                    if (id == no_vehicle || !stored_line
+                        || std::get<input::line_source_t>(*stored_line) != input::line_source_t::arena)
+                        continue;
+                    auto &[offset, length] = std::get<input::input_slice_t>(*stored_line);
+                    auto new_offset = spare.size();
+                    spare.append(bytes, offset, length);
+                    offset = new_offset;
+                }
+                bytes.swap(spare);
+                live = bytes.size();
+            }
+
+            stored_source_t store_source(state_t &state, const entry_source_t &source) {
+                if (auto line_desc = std::get_if<input::line_desc_ref_t>(&source))
+                    return store_line(state, *line_desc);
+                return std::get<event_no_t>(source);
+            }
+
+            rejected_source_t load_source(const state_t &state, const stored_source_t &source) {
+                if (auto stored_line = std::get_if<input::stored_line_t>(&source))
+                    return input::line_error_desc_t(load_line(state, *stored_line));
+                return std::get<event_no_t>(source);
+            }
+        }
+
+        input::line_desc_ref_t load_line(const state_t &state, const input::stored_line_t &stored_line) {
+            const auto &[line_no, source, slice] = stored_line;
+            const auto &[offset, length] = slice;
+            const auto &bytes = source == input::line_source_t::arena
+                                ? std::string_view(state.line_arena.bytes)
+                                : state.mapped_input;
+            return input::line_desc_ref_t(line_no, bytes.substr(offset, length));
+        }
+
+        void update_top(state_t &state, size_t type, vehicle::vehicle_id_t id) {
+            auto &top_heap = state.top_vehicles[type];
+            auto &[heap, positions] = top_heap;
+            // Once the heap is full, most vehicles rank below its top and are skipped without a lookup.
+            if (heap.size() == max_top && heap.front() != id && !ranks_before(state, type, id, heap.front()))
+                return;
+            if (positions.size() <= id)
+                positions.resize(id + 1, no_position);
+            if (positions[id] != no_position)
+                sift_down(state, type, top_heap, positions[id]);
+            else if (heap.size() < max_top) {
+                positions[id] = uint32_t(heap.size());
+                heap.push_back(id);
+                sift_up(state, type, top_heap, heap.size() - 1);
+            } else if (ranks_before(state, type, id, heap.front())) {
+                positions[heap.front()] = no_position;
+                heap.front() = id;
+                positions[id] = 0;
+                sift_down(state, type, top_heap, 0);
+            }
+        }
+
+        size_t probe(const not_finished_data_t &not_finished, vehicle::vehicle_id_t id) {
+            const auto &slots = std::get<std::vector<not_finished_slot_t>>(not_finished);
+            auto index = home_slot(slots, id);
+            while (std::get<vehicle::vehicle_id_t>(slots[index]) != id
+                   && std::get<vehicle::vehicle_id_t>(slots[index]) != no_vehicle)
+                index = (index + 1) & (slots.size() - 1);
+            return index;
+        }
+
+        void reserve_slot(not_finished_data_t &not_finished) {
+            auto &[slots, used] = not_finished;
+            if ((used + 1) * 4 <= slots.size() * 3)
+                return;
+            std::vector<not_finished_slot_t> old_slots(std::max<size_t>(16, slots.size() * 2),
+                                                       not_finished_slot_t(no_vehicle, not_finished_entry_t()));
+            old_slots.swap(slots);
+            for (auto &slot : old_slots)
+                if (std::get<vehicle::vehicle_id_t>(slot) != no_vehicle)
+                    slots[probe(not_finished, std::get<vehicle::vehicle_id_t>(slot))] = std::move(slot);
+        }
+
+        input::stored_line_t store_line(state_t &state, const input::line_desc_ref_t &line_desc) {
+            const auto &[line_no, line] = line_desc;
+            if (input::is_mapped(state.mapped_input, line)) {
+                input::input_slice_t slice(line.data() - state.mapped_input.data(), line.size());
+                return input::stored_line_t(line_no, input::line_source_t::mapped_input, slice);
+            }
+            compact_lines(state);
+            auto &[bytes, spare, live] = state.line_arena;
+            input::input_slice_t slice(bytes.size(), line.size());
+            bytes.append(line);
+            live += line.size();
+            return input::stored_line_t(line_no, input::line_source_t::arena, slice);
+        }
+
+        std::optional<rejected_source_t> add_entry(state_t &state, const vehicle::vehicle_ref_t &vehicle,
+                                                   const road::road_t &road, const road::distance_t &distance,
+                                                   const entry_source_t &source) {
+            auto id = vehicle::intern(state.table, vehicle);
+            auto &not_finished = state.not_finished;
+            reserve_slot(not_finished);
+            auto index = probe(not_finished, id);
+            auto &[slot_id, entry] = std::get<std::vector<not_finished_slot_t>>(not_finished)[index];
+            if (slot_id == no_vehicle) {
+                slot_id = id;
+                entry = not_finished_entry_t(road, distance, store_source(state, source));
+                std::get<size_t>(not_finished)++;
+                return std::nullopt;
+            }
+            auto &[not_finished_road, start_distance, paired_source] = entry;
+            if (not_finished_road == road) {
+                auto traveled_distance = std::abs(road::total_distance_t(distance) - start_distance);
+                auto &vehicles_data = state.vehicles_data;
+                add_road_distance(state.roads_data, road, traveled_distance);
+                add_window_distance(state.road_window, road, traveled_distance);
+                if (vehicles_data.size() <= id)
+                    vehicles_data.resize(id + 1);
+                if (!has_trips(vehicles_data[id]))
+                    state.vehicles_order.added.push_back(id);
+                add_type_distance(vehicles_data[id], std::get<road::road_type_t>(road), traveled_distance);
+                update_top(state, road::type_index(std::get<road::road_type_t>(road)), id);
+                release_source(state, paired_source);
+                erase_slot(not_finished, index);
+                return std::nullopt;
+            }
+            std::optional<rejected_source_t> rejected(load_source(state, paired_source));
+            release_source(state, paired_source);
+            entry = not_finished_entry_t(road, distance, store_source(state, source));
+            return rejected;
+        }
+
+        const road_type_data_t *find_vehicle_data(const state_t &state, const vehicle::vehicle_ref_t &vehicle) {
+            const auto &vehicles_data = state.vehicles_data;
+            auto id = vehicle::find_id(state.table, vehicle);
+            if (!id || id.value() >= vehicles_data.size() || !has_trips(vehicles_data[id.value()]))
+                return nullptr;
+            return &vehicles_data[id.value()];
+        }
+    }
+}
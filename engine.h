@@ -0,0 +1,337 @@
+#ifndef NOD_ENGINE_H
+#define NOD_ENGINE_H
+
+#include <algorithm>
+#include <array>
+#include <bitset>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <utility>
+#include <variant>
+#include <vector>
+
+// The toll charging state of nod.cc and what it is built from: the validators of the scanner, roads, vehicles
+// and the stored lines of pending entries. Shared by nod.cc and the nod_engine library of nod.h. Only types,
+// constants and inline functions are defined here; everything else is defined once, in engine.cc.
+namespace nod::detail {
+    namespace scanner {
+        // Character classes of the grammar as bits of a byte indexed table, built at compile time.
+        using char_class_t = uint8_t;
+        constexpr char_class_t space_class = 1, digit_class = 2, alnum_class = 4, road_type_class = 8;
+
+        constexpr std::array<char_class_t, 256> make_char_classes() {
+            std::array<char_class_t, 256> classes{};
+            for (char c : std::string_view(" \t\n\v\f\r"))
+                classes[uint8_t(c)] |= space_class;
+            for (int c = 0; c < 256; c++) {
+                if (c >= '0' && c <= '9')
+                    classes[c] |= digit_class | alnum_class;
+                if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'))
+                    classes[c] |= alnum_class;
+            }
+            classes['A'] |= road_type_class;
+            classes['S'] |= road_type_class;
+            return classes;
+        }
+
+        constexpr std::array<char_class_t, 256> char_classes = make_char_classes();
+
+        template<char_class_t Class>
+        constexpr bool is(char c) {
+            return char_classes[uint8_t(c)] & Class;
+        }
+
+        constexpr bool is_space(char c) {
+            return is<space_class>(c);
+        }
+
+        constexpr bool is_digit(char c) {
+            return is<digit_class>(c);
+        }
+
+        // Matches Class{MinLength,MaxLength}. The classes of all bytes are and-ed together, so the loop has
+        // no early exits.
+        template<char_class_t Class, size_t MinLength, size_t MaxLength>
+        constexpr bool matches(std::string_view str) {
+            char_class_t common = Class;
+            for (char c : str)
+                common &= char_classes[uint8_t(c)];
+            return str.size() >= MinLength && str.size() <= MaxLength && common;
+        }
+
+        // Longest words is_plate_no, scan_road_num and scan_distance accept. Scanning one more byte
+        // is enough to reject a word.
+        constexpr size_t max_plate_length = 11, max_road_length = 4, max_distance_length = 12;
+
+        // Matches [a-zA-Z0-9]{3,11}.
+        constexpr bool is_plate_no(std::string_view str) {
+            return matches<alnum_class, 3, 11>(str);
+        }
+
+        // Matches (A|S)([1-9]\d{0,2}) and returns the road number.
+        constexpr std::optional<int> scan_road_num(std::string_view str) {
+            if (str.empty() || !is<road_type_class>(str[0]) || !matches<digit_class, 1, 3>(str.substr(1))
+                || str[1] == '0')
+                return std::nullopt;
+            int num = 0;
+            for (char c : str.substr(1))
+                num = num * 10 + (c - '0');
+            return num;
+        }
+
+        // Matches (0|[1-9]\d*),(\d) and returns the distance in tenths of km. Distances whose tenths do
+        // not fit into an int are rejected; ten digits of junction always fit into the 64-bit accumulator.
+        constexpr std::optional<int> scan_distance(std::string_view str) {
+            if (str.size() < 3 || str[str.size() - 2] != ',' || !is_digit(str.back()))
+                return std::nullopt;
+            auto junction = str.substr(0, str.size() - 2);
+            if ((junction.size() > 1 && junction[0] == '0') || !matches<digit_class, 1, 10>(junction))
+                return std::nullopt;
+            int64_t value = 0;
+            for (char c : junction)
+                value = value * 10 + (c - '0');
+            value = value * 10 + (str.back() - '0');
+            if (value > std::numeric_limits<int>::max())
+                return std::nullopt;
+            return int(value);
+        }
+
+        static_assert(is_plate_no("eLo") && is_plate_no("W1234567") && !is_plate_no("AB") && !is_plate_no("W-12"));
+        static_assert(scan_road_num("A1") == 1 && scan_road_num("S999") == 999 && !scan_road_num("A01")
+                      && !scan_road_num("S1000") && !scan_road_num("B1") && !scan_road_num("A"));
+        static_assert(scan_distance("0,0") == 0 && scan_distance("734,1") == 7341 && !scan_distance("01,0")
+                      && !scan_distance("1,") && scan_distance("214748364,7") == 2147483647
+                      && !scan_distance("214748364,8") && !scan_distance("9999999999,9"));
+    }
+
+    namespace road {
+        using road_type_t = char;
+        using road_num_t = int;
+        using road_t = std::tuple<road_num_t, road_type_t>;
+        // Distances of single records are in tenths of km and fit into an int. Sums over many records
+        // are kept in 64 bits, which cannot overflow before 2^32 records of the largest distance.
+        using distance_t = int;
+        using total_distance_t = int64_t;
+
+        constexpr road_num_t max_road_num = 999;
+        constexpr size_t road_slots = 2 * (max_road_num + 1);
+
+        // Road types in output order, and the index of a type among them.
+        constexpr std::array<road_type_t, 2> road_types = {'A', 'S'};
+
+        constexpr size_t type_index(road_type_t road_type) {
+            return road_type == 'S';
+        }
+
+        // Dense index of a road, ordered by number and then by type (A before S).
+        constexpr size_t road_index(const road_t &road) {
+            return size_t(std::get<road_num_t>(road)) * road_types.size() + type_index(std::get<road_type_t>(road));
+        }
+
+        constexpr road_t road_at(size_t index) {
+            return road_t(road_num_t(index / road_types.size()), road_types[index % road_types.size()]);
+        }
+    }
+
+    namespace vehicle {
+        // Zero padded plate number. Compares and orders exactly like the original string.
+        using plate_no_t = std::array<char, 16>;
+        using vehicle_id_t = uint32_t;
+        // Non-owning vehicle, pointing into the line it was parsed from.
+        using vehicle_ref_t = std::tuple<std::string_view>;
+
+        inline plate_no_t to_plate_no(const vehicle_ref_t &vehicle) {
+            auto str = std::get<std::string_view>(vehicle);
+            plate_no_t plate_no{};
+            std::copy_n(str.begin(), std::min(str.size(), plate_no.size()), plate_no.begin());
+            return plate_no;
+        }
+
+        struct plate_no_hash {
+            size_t operator()(const plate_no_t &plate_no) const {
+                uint64_t low, high;
+                std::memcpy(&low, plate_no.data(), sizeof(low));
+                std::memcpy(&high, plate_no.data() + sizeof(low), sizeof(high));
+                uint64_t hash = (low ^ (high * 0x9e3779b97f4a7c15ULL)) * 0xbf58476d1ce4e5b9ULL;
+                return size_t(hash ^ (hash >> 31));
+            }
+        };
+
+        // Robin Hood hash index of the interned plates. A slot holds the upper half of the plate number hash
+        // and the id, the plate number itself is only read from plates_t to confirm a match. Inserting
+        // displaces slots that are closer to their home slot, so a lookup can stop at the first slot closer
+        // to its home than the probed plate number would be.
+        using plate_slot_t = std::tuple<uint32_t, vehicle_id_t>;
+        using plates_index_t = std::vector<plate_slot_t>;
+        // Every plate number seen so far gets a dense id, handed out in order of appearance.
+        using plates_t = std::vector<plate_no_t>;
+        using intern_table_t = std::tuple<plates_index_t, plates_t>;
+
+        constexpr vehicle_id_t no_id = std::numeric_limits<vehicle_id_t>::max();
+        constexpr size_t initial_index_size = 16;
+
+        vehicle_id_t intern(intern_table_t &table, const vehicle_ref_t &vehicle);
+
+        std::optional<vehicle_id_t> find_id(const intern_table_t &table, const vehicle_ref_t &vehicle);
+
+        inline const plate_no_t &plate_no(const intern_table_t &table, vehicle_id_t id) {
+            return std::get<plates_t>(table)[id];
+        }
+    }
+
+    namespace input {
+        using line_no_t = int;
+        using line_t = std::string;
+        // Non-owning line, pointing into the input buffer.
+        using line_desc_ref_t = std::tuple<line_no_t, std::string_view>;
+        using line_desc_t = std::tuple<line_no_t, line_t>;
+        using line_error_desc_t = line_desc_t;
+
+        // Line kept for a later error report. Its bytes are not copied into a string of their own, only
+        // the offset and length are stored, either into the mapped input file or into a line arena.
+        enum class line_source_t : uint8_t {
+            mapped_input, arena
+        };
+        using input_slice_t = std::tuple<uint64_t, uint32_t>;
+        using stored_line_t = std::tuple<line_no_t, line_source_t, input_slice_t>;
+    }
+
+    namespace toll_charging {
+        // Distance per road type in road::type_index order, and a mask of the types with a finished trip.
+        using road_type_data_t = std::tuple<std::array<road::total_distance_t, road::road_types.size()>, uint8_t>;
+        // Indexed by vehicle id. Vehicles without a finished trip have an empty mask.
+        using vehicles_data_t = std::vector<road_type_data_t>;
+
+        inline bool has_trips(const road_type_data_t &entries) {
+            return std::get<uint8_t>(entries) != 0;
+        }
+
+        inline void add_type_distance(road_type_data_t &entries, road::road_type_t road_type,
+                                      road::total_distance_t distance) {
+            auto &[distances, mask] = entries;
+            auto index = road::type_index(road_type);
+            distances[index] += distance;
+            mask |= uint8_t(1) << index;
+        }
+        // Indexed by road::road_index. Only roads marked as present have been traveled.
+        using roads_data_t = std::tuple<std::array<road::total_distance_t, road::road_slots>,
+                                        std::bitset<road::road_slots>>;
+
+        // Number of an event ingested through nod.h, from 1. Such entries have no line.
+        using event_no_t = uint64_t;
+        // Where an entry comes from: a line of the input or an event of nod.h.
+        using entry_source_t = std::variant<input::line_desc_ref_t, event_no_t>;
+        // The source of a pending entry, with its line kept as a stored line.
+        using stored_source_t = std::variant<input::stored_line_t, event_no_t>;
+        // The source of an unpaired entry, with its line copied.
+        using rejected_source_t = std::variant<input::line_error_desc_t, event_no_t>;
+
+        using not_finished_entry_t = std::tuple<road::road_t, road::distance_t, stored_source_t>;
+        using not_finished_slot_t = std::tuple<vehicle::vehicle_id_t, not_finished_entry_t>;
+        // Open addressing table with linear probing, keyed by vehicle id, and the number of used slots.
+        // Erasing shifts the following slots back, so there are no tombstones.
+        using not_finished_data_t = std::tuple<std::vector<not_finished_slot_t>, size_t>;
+
+        constexpr vehicle::vehicle_id_t no_vehicle = std::numeric_limits<vehicle::vehicle_id_t>::max();
+
+        struct vehicles_order_t {
+            // Ids of vehicles with a finished trip, ordered by plate number.
+            std::vector<vehicle::vehicle_id_t> sorted;
+            // Ids that got their first finished trip since sorted was last brought up to date.
+            std::vector<vehicle::vehicle_id_t> added;
+        };
+
+        struct line_arena_t {
+            // Bytes of pending lines that are not in the mapped input, and a spare buffer used when compacting.
+            std::string bytes, spare;
+            // Number of bytes still referenced by pending entries.
+            size_t live = 0;
+        };
+        constexpr size_t min_compacted_arena = 1 << 16;
+
+        // Road totals of the trips finished in each of the last max_window epochs, and the number of the
+        // current epoch. Every command but ?#stats and ?#top ends an epoch. Epoch e is kept in the bucket
+        // e % max_window, and the buckets are only allocated once a trip finishes.
+        using road_window_t = std::tuple<std::vector<roads_data_t>, uint64_t>;
+        constexpr size_t max_window = 64;
+
+        // Per road type, a min-heap of the max_top vehicles ranked highest by their total on it, and the
+        // heap position of every vehicle id. Totals only grow, so a vehicle outside of the heap never ranks
+        // above its top, and becomes part of it once it does.
+        using top_heap_t = std::tuple<std::vector<vehicle::vehicle_id_t>, std::vector<uint32_t>>;
+        using top_vehicles_t = std::array<top_heap_t, road::road_types.size()>;
+        constexpr size_t max_top = 1000;
+        constexpr uint32_t no_position = std::numeric_limits<uint32_t>::max();
+
+        struct state_t {
+            vehicle::intern_table_t table;
+            vehicles_data_t vehicles_data;
+            roads_data_t roads_data;
+            not_finished_data_t not_finished;
+            vehicles_order_t vehicles_order;
+            line_arena_t line_arena;
+            // The input file, when the caller mapped it into memory for this state. Lines stored from it point
+            // into it, so it stays mapped as long as the state is used.
+            std::string_view mapped_input;
+            road_window_t road_window;
+            top_vehicles_t top_vehicles;
+        };
+
+        input::line_desc_ref_t load_line(const state_t &state, const input::stored_line_t &stored_line);
+
+        inline void add_road_distance(roads_data_t &roads_data, const road::road_t &road,
+                                      road::total_distance_t distance) {
+            auto &[distances, present] = roads_data;
+            auto index = road::road_index(road);
+            distances[index] += distance;
+            present.set(index);
+        }
+
+        inline const road::total_distance_t *find_road_data(const roads_data_t &roads_data, const road::road_t &road) {
+            const auto &[distances, present] = roads_data;
+            auto index = road::road_index(road);
+            return present.test(index) ? &distances[index] : nullptr;
+        }
+
+        // Calls handle_road(road, distance) for every traveled road, in output order.
+        template<typename Handler>
+        void for_each_road(const roads_data_t &roads_data, Handler &&handle_road) {
+            const auto &[distances, present] = roads_data;
+            for (size_t index = 0; index < road::road_slots; index++)
+                if (present.test(index))
+                    handle_road(road::road_at(index), distances[index]);
+        }
+
+        // Higher totals rank first, then lower plate numbers.
+        inline bool ranks_before(road::total_distance_t lhs_total, const vehicle::plate_no_t &lhs_plate_no,
+                                 road::total_distance_t rhs_total, const vehicle::plate_no_t &rhs_plate_no) {
+            return lhs_total != rhs_total ? lhs_total > rhs_total : lhs_plate_no < rhs_plate_no;
+        }
+
+        // Called whenever the total of the vehicle on the road type has grown.
+        void update_top(state_t &state, size_t type, vehicle::vehicle_id_t id);
+
+        // Index of the slot holding id, or of the empty slot where it belongs.
+        size_t probe(const not_finished_data_t &not_finished, vehicle::vehicle_id_t id);
+
+        // Makes sure one more entry can be inserted while keeping the load factor below 3/4.
+        void reserve_slot(not_finished_data_t &not_finished);
+
+        input::stored_line_t store_line(state_t &state, const input::line_desc_ref_t &line_desc);
+
+        // Pairs the entry with the pending one of the vehicle, or makes it pending. Returns the source of a pending
+        // entry that it replaced, which is unpaired.
+        std::optional<rejected_source_t> add_entry(state_t &state, const vehicle::vehicle_ref_t &vehicle,
+                                                   const road::road_t &road, const road::distance_t &distance,
+                                                   const entry_source_t &source);
+
+        const road_type_data_t *find_vehicle_data(const state_t &state, const vehicle::vehicle_ref_t &vehicle);
+    }
+}
+
+#endif
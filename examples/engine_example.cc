@@ -0,0 +1,37 @@
+// Embeds the engine of nod.h: ingests a few typed events and prints what nod would print for them:
+//   engine_example
+// Only uses nod.h and the nod_engine library, as programs outside this tree would.
+#include <cstdio>
+#include <string_view>
+#include <vector>
+
+#include "nod.h"
+
+int main() {
+    nod::TollEngine engine;
+    std::vector<nod::Event> events = {
+        {"WI1234", {'A', 2}, 93},  {"WI1234", {'A', 2}, 1167},
+        {"KR7777", {'S', 7}, 400}, {"KR7777", {'A', 2}, 60},
+        {"KR7777", {'A', 2}, 70},  {"X", {'A', 2}, 0},
+    };
+    for (const auto &rejection : engine.ingest(events))
+        std::printf("Event %llu: %s\n", static_cast<unsigned long long>(rejection.event),
+                    rejection.reason == nod::Rejection::Reason::invalid ? "invalid" : "unpaired");
+
+    for (std::string_view plate_no : {"WI1234", "KR7777", "NOBODY"}) {
+        auto totals = engine.query_vehicle(plate_no);
+        if (!totals)
+            continue;
+        std::printf("%.*s", int(plate_no.size()), plate_no.data());
+        if (totals->motorway)
+            std::printf(" A %lld,%lld", static_cast<long long>(*totals->motorway / 10),
+                        static_cast<long long>(*totals->motorway % 10));
+        if (totals->expressway)
+            std::printf(" S %lld,%lld", static_cast<long long>(*totals->expressway / 10),
+                        static_cast<long long>(*totals->expressway % 10));
+        std::printf("\n");
+    }
+    if (auto total = engine.query_road({'A', 2}))
+        std::printf("A2 %lld,%lld\n", static_cast<long long>(*total / 10), static_cast<long long>(*total % 10));
+    return 0;
+}
@@ -1,121 +1,839 @@
-#include <iostream>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bitset>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <cstdlib>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <functional>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <new>
 #include <optional>
 #include <regex>
-#include <map>
-#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#if defined(NOD_ZLIB)
+#include <zlib.h>
+#endif
+
+#include "engine.h"
 
 namespace {
+    namespace scanner = nod::detail::scanner;
+    namespace road = nod::detail::road;
+    namespace vehicle = nod::detail::vehicle;
+    namespace toll_charging = nod::detail::toll_charging;
+
+    namespace options {
+        // Use the std::regex based validators instead of the hand-written scanner.
+        // Kept as a reference implementation for differential testing.
+        bool regex_reference = false;
+        // Print the runtime stats to stderr at the end of the input, like the ?#stats command does.
+        bool stats_at_exit = false;
+        // Error reports printed at most. Later ones are only counted, and summed up at the end.
+        uint64_t error_limit = std::numeric_limits<uint64_t>::max();
+
+        // A non-negative decimal number and nothing else, that fits into 64 bits.
+        std::optional<uint64_t> parse_count(std::string_view str) {
+            uint64_t value;
+            auto [end, error] = std::from_chars(str.data(), str.data() + str.size(), value);
+            if (error != std::errc() || end != str.data() + str.size())
+                return std::nullopt;
+            return value;
+        }
+    }
+
+    // Building with NOD_ALLOC_STATS replaces every form of the global operator new and delete, to count the
+    // allocations for --alloc-stats. It costs two atomic additions per allocation, so it is left out otherwise.
+    namespace memory {
+#if defined(NOD_ALLOC_STATS)
+        constexpr bool counted = true;
+#else
+        constexpr bool counted = false;
+#endif
+        std::atomic<uint64_t> allocations{0}, allocated_bytes{0};
+
+#if defined(NOD_ALLOC_STATS)
+        // Serves all forms of operator new, so all forms of operator delete free with std::free. Returns
+        // nullptr when out of memory.
+        void *counted_allocate(size_t size, std::align_val_t alignment = std::align_val_t(0)) {
+            allocations.fetch_add(1, std::memory_order_relaxed);
+            allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+            auto align = size_t(alignment);
+            if (align <= alignof(std::max_align_t))
+                return std::malloc(size ? size : 1);
+            // aligned_alloc wants a multiple of the alignment.
+            return std::aligned_alloc(align, (std::max<size_t>(size, 1) + align - 1) / align * align);
+        }
+
+        void *checked(void *pointer) {
+            if (!pointer)
+                throw std::bad_alloc();
+            return pointer;
+        }
+#endif
+
+        constexpr size_t initial_arena_size = 1 << 16;
+
+        // Monotonic arena for temporaries that all die together. Its buffer is kept between uses and grows
+        // to the largest size needed so far, so once warmed up it serves everything without allocating.
+        class arena_t {
+        public:
+            arena_t() : buffer(initial_arena_size) {
+                monotonic.emplace(buffer.data(), buffer.size(), &overflow);
+            }
+
+            std::pmr::memory_resource *resource() {
+                return &*monotonic;
+            }
+
+            // Everything allocated from the arena must be destroyed before.
+            void reset() {
+                monotonic.reset();
+                if (overflow.bytes > 0)
+                    buffer.resize(buffer.size() + 2 * overflow.bytes);
+                overflow.bytes = 0;
+                monotonic.emplace(buffer.data(), buffer.size(), &overflow);
+            }
+
+        private:
+            // Counts the bytes that did not fit into the buffer.
+            struct overflow_resource_t : std::pmr::memory_resource {
+                size_t bytes = 0;
+
+                void *do_allocate(size_t size, size_t alignment) override {
+                    bytes += size;
+                    return std::pmr::new_delete_resource()->allocate(size, alignment);
+                }
+
+                void do_deallocate(void *pointer, size_t size, size_t alignment) override {
+                    std::pmr::new_delete_resource()->deallocate(pointer, size, alignment);
+                }
+
+                bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+                    return this == &other;
+                }
+            };
+
+            std::vector<std::byte> buffer;
+            overflow_resource_t overflow;
+            std::optional<std::pmr::monotonic_buffer_resource> monotonic;
+        };
+    }
+
+    // Counters and stage timers of the thread reading the input, printed by the ?#stats command. Building
+    // with NOD_NO_STATS compiles them out, and the command is not recognized then.
+    namespace stats {
+#if defined(NOD_NO_STATS)
+        constexpr bool enabled = false;
+#else
+        constexpr bool enabled = true;
+#endif
+
+        using steady_clock_t = std::chrono::steady_clock;
+
+        struct counters_t {
+            uint64_t lines = 0, empty_lines = 0, info_lines = 0, command_lines = 0, invalid_lines = 0;
+            uint64_t error_reports = 0, bytes_read = 0, bytes_written = 0;
+            // Nanoseconds spent blocked in read, answering commands and writing output.
+            uint64_t read_ns = 0, command_ns = 0, write_ns = 0;
+        };
+
+        counters_t counters;
+        const steady_clock_t::time_point start = steady_clock_t::now();
+
+        void add(uint64_t &counter, uint64_t value) {
+            if constexpr (enabled)
+                counter += value;
+        }
+
+        uint64_t elapsed_ns(steady_clock_t::time_point since) {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(steady_clock_t::now() - since).count();
+        }
+
+        // Adds the time until the end of its scope to a counter.
+        class timer_t {
+        public:
+            explicit timer_t(uint64_t &counter) : counter(counter) {
+                if constexpr (enabled)
+                    started = steady_clock_t::now();
+            }
+
+            ~timer_t() {
+                if constexpr (enabled)
+                    counter += elapsed_ns(started);
+            }
+
+        private:
+            uint64_t &counter;
+            steady_clock_t::time_point started;
+        };
+    }
+
+    namespace output {
+        constexpr size_t buffer_capacity = 1 << 16;
+
+        // Output of both streams goes through a single buffer, so switching to the other stream flushes it
+        // and the relative order of stdout and stderr writes is preserved.
+        std::string buffer;
+        int buffered_fd = -1;
+
+        // Returns false when not all of data could be written.
+        bool write_all(int fd, std::string_view data) {
+            stats::timer_t timer(stats::counters.write_ns);
+            while (!data.empty()) {
+                ssize_t count = ::write(fd, data.data(), data.size());
+                if (count < 0 && errno == EINTR)
+                    continue;
+                if (count <= 0)
+                    return false;
+                data.remove_prefix(count);
+            }
+            return true;
+        }
+
+        // Replaces the contents of the file at path. A regular file is replaced atomically: data goes to
+        // path.tmp, which is synced and then renamed over path, so a failed or interrupted write keeps the
+        // previous contents. Anything else, like a device or a pipe, is written in place.
+        bool write_file(const char *path, std::string_view data) {
+            struct stat info;
+            if (stat(path, &info) == 0 && !S_ISREG(info.st_mode)) {
+                int fd = open(path, O_WRONLY | O_TRUNC);
+                if (fd < 0)
+                    return false;
+                bool written = write_all(fd, data);
+                return close(fd) == 0 && written;
+            }
+            std::string temp_path = std::string(path) + ".tmp";
+            int fd = open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0)
+                return false;
+            bool written = write_all(fd, data) && fsync(fd) == 0;
+            if (close(fd) != 0 || !written || rename(temp_path.c_str(), path) != 0) {
+                unlink(temp_path.c_str());
+                return false;
+            }
+            return true;
+        }
+
+        void flush() {
+            write_all(buffered_fd, buffer);
+            buffer.clear();
+        }
+
+        // Set by commands. Answers to consecutive commands are flushed together, once another line follows
+        // them or before waiting for more input.
+        bool answers_pending = false;
+
+        void flush_answers() {
+            if (answers_pending)
+                flush();
+            answers_pending = false;
+        }
+
+        // While set, everything written to either stream by this thread is appended here instead, to be sent
+        // to a socket. Captured bytes are counted once they are sent.
+        thread_local std::string *captured = nullptr;
+
+        void append(int fd, std::string_view data) {
+            if (captured) {
+                captured->append(data);
+                return;
+            }
+            stats::add(stats::counters.bytes_written, data.size());
+            if (fd != buffered_fd) {
+                flush();
+                buffered_fd = fd;
+            }
+            if (buffer.size() + data.size() > buffer_capacity) {
+                flush();
+                if (data.size() > buffer_capacity) {
+                    write_all(fd, data);
+                    return;
+                }
+            }
+            buffer.append(data);
+        }
+
+        struct writer_t {
+            int fd;
+        };
+
+        writer_t out{STDOUT_FILENO};
+        writer_t err{STDERR_FILENO};
+
+        writer_t &operator<<(writer_t &writer, std::string_view str) {
+            append(writer.fd, str);
+            return writer;
+        }
+
+        writer_t &operator<<(writer_t &writer, char c) {
+            return writer << std::string_view(&c, 1);
+        }
+
+        template<typename Integer, typename = std::enable_if_t<std::is_integral_v<Integer>>>
+        writer_t &operator<<(writer_t &writer, Integer value) {
+            char digits[24];
+            auto end = std::to_chars(std::begin(digits), std::end(digits), value).ptr;
+            return writer << std::string_view(digits, end - digits);
+        }
+    }
+
+    // Compressed input is recognized by its magic bytes. Gzip is inflated when built with NOD_ZLIB and linked
+    // with -lz, on a thread of its own, so the reading thread only splits and handles the inflated lines.
+    namespace decompress {
+        enum class format_t : uint8_t {
+            none, gzip, zstd
+        };
+
+        constexpr std::string_view gzip_magic = "\x1f\x8b", zstd_magic = "\x28\xb5\x2f\xfd";
+        constexpr size_t magic_size = zstd_magic.size();
+
+        format_t detect(std::string_view head) {
+            if (head.substr(0, gzip_magic.size()) == gzip_magic)
+                return format_t::gzip;
+            if (head.substr(0, zstd_magic.size()) == zstd_magic)
+                return format_t::zstd;
+            return format_t::none;
+        }
+
+        // Input is still undecided while it is a proper prefix of a magic. Neither magic starts with a byte
+        // of a valid line, so waiting for more of it never holds up a command.
+        bool undecided(std::string_view head) {
+            return head.size() < magic_size && !head.empty() && detect(head) == format_t::none
+                   && (gzip_magic.substr(0, head.size()) == head || zstd_magic.substr(0, head.size()) == head);
+        }
+
+        bool supported(format_t format) {
+#if defined(NOD_ZLIB)
+            return format != format_t::zstd;
+#else
+            return format == format_t::none;
+#endif
+        }
+
+        // Reads into data and returns the number of bytes read, 0 at the end and -1 on errors, like read.
+        using source_t = std::function<ssize_t(char *, size_t)>;
+
+#if defined(NOD_ZLIB)
+        constexpr size_t compressed_chunk_size = 1 << 18;
+        constexpr size_t inflated_block_size = 1 << 20;
+        constexpr size_t max_inflated_blocks = 4;
+
+        // Inflates gzip input from source on its own thread, a few blocks ahead of the reader. Concatenated
+        // gzip members are read as one stream, as gzip -d does.
+        class inflater_t {
+        public:
+            explicit inflater_t(source_t source) : source(std::move(source)), thread([this]() { loop(); }) {
+            }
+
+            ~inflater_t() {
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    stopping = true;
+                }
+                space.notify_one();
+                thread.join();
+            }
+
+            // Copies inflated bytes into data. Returns 0 at the end of the input, and also once it turns out
+            // to be corrupt or truncated, which failed tells apart.
+            ssize_t read(char *data, size_t size) {
+                if (offset == current.size()) {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    ready.wait(lock, [this]() { return !blocks.empty() || finished; });
+                    if (blocks.empty())
+                        return 0;
+                    current = std::move(blocks.front());
+                    blocks.erase(blocks.begin());
+                    offset = 0;
+                    space.notify_one();
+                }
+                size = std::min(size, current.size() - offset);
+                std::memcpy(data, current.data() + offset, size);
+                offset += size;
+                return ssize_t(size);
+            }
+
+            bool failed() {
+                std::lock_guard<std::mutex> lock(mutex);
+                return corrupt;
+            }
+
+            // Whether read returns without waiting for the inflating thread.
+            bool available() {
+                if (offset < current.size())
+                    return true;
+                std::lock_guard<std::mutex> lock(mutex);
+                return !blocks.empty() || finished;
+            }
+
+        private:
+            // Hands the inflated bytes over to the reader, waiting while it is too far behind. Returns
+            // false when stopping.
+            bool push(std::string &block) {
+                std::unique_lock<std::mutex> lock(mutex);
+                space.wait(lock, [this]() { return stopping || blocks.size() < max_inflated_blocks; });
+                if (stopping)
+                    return false;
+                blocks.push_back(std::move(block));
+                ready.notify_one();
+                block.clear();
+                return true;
+            }
+
+            void loop() {
+                z_stream stream{};
+                // Window bits of 15 plus 32 accept both gzip and zlib headers.
+                bool ok = inflateInit2(&stream, 15 + 32) == Z_OK;
+                std::vector<char> in(compressed_chunk_size);
+                std::string block;
+                int status = Z_OK;
+                while (ok) {
+                    if (stream.avail_in == 0) {
+                        // Inflated bytes are passed on before waiting for more input, so lines that have
+                        // arrived are handled right away.
+                        if (!block.empty() && !push(block))
+                            break;
+                        ssize_t count;
+                        while ((count = source(in.data(), in.size())) < 0 && errno == EINTR)
+                            ;
+                        if (count <= 0) {
+                            ok = count == 0 && status == Z_STREAM_END;
+                            break;
+                        }
+                        stream.next_in = reinterpret_cast<Bytef *>(in.data());
+                        stream.avail_in = uInt(count);
+                    }
+                    if (status == Z_STREAM_END)
+                        ok = inflateReset(&stream) == Z_OK;
+                    auto filled = block.size();
+                    block.resize(inflated_block_size);
+                    stream.next_out = reinterpret_cast<Bytef *>(block.data() + filled);
+                    stream.avail_out = uInt(block.size() - filled);
+                    status = inflate(&stream, Z_NO_FLUSH);
+                    block.resize(block.size() - stream.avail_out);
+                    ok = ok && (status == Z_OK || status == Z_STREAM_END || status == Z_BUF_ERROR);
+                    if (ok && block.size() == inflated_block_size && !push(block))
+                        break;
+                }
+                if (ok && !block.empty())
+                    push(block);
+                inflateEnd(&stream);
+                std::lock_guard<std::mutex> lock(mutex);
+                finished = true;
+                corrupt = !ok;
+                ready.notify_one();
+            }
+
+            source_t source;
+            // Block the reader copies from, and how much of it is consumed.
+            std::string current;
+            size_t offset = 0;
+            std::mutex mutex;
+            std::condition_variable ready, space;
+            std::vector<std::string> blocks;
+            bool stopping = false, finished = false, corrupt = false;
+            // Members are initialized in declaration order, so loop only starts once source and the queue exist.
+            std::thread thread;
+        };
+#endif
+    }
+
+    using view_match_t = std::match_results<std::string_view::const_iterator>;
+}
+
+// What nod.cc adds to the namespaces of engine.h.
+namespace nod::detail {
     namespace road {
-        using road_type_t = char;
-        using road_num_t = int;
-        using road_t = std::tuple<road_num_t, road_type_t>;
-        using distance_t = int;
-
-        std::optional<road_t> parse_road(const std::string &road_str) {
-            static const std::regex road_regex(R"~(^(A|S)([1-9]\d{0,2})$)~");
-            std::smatch match;
-            if (std::regex_search(road_str, match, road_regex))
-                return road_t(road_num_t(std::stoul(match.str(2))), match.str(1)[0]);
+        namespace reference {
+            std::optional<road_t> parse_road(std::string_view road_str) {
+                static const std::regex road_regex(R"~(^(A|S)([1-9]\d{0,2})$)~");
+                view_match_t match;
+                if (std::regex_search(road_str.begin(), road_str.end(), match, road_regex))
+                    return road_t(road_num_t(std::stoul(match.str(2))), match.str(1)[0]);
+                return std::nullopt;
+            }
+
+            std::optional<distance_t> parse_distance(std::string_view distance_str) {
+                static const std::regex plate_no_regex(R"~(^(0|[1-9]\d*),(\d)$)~");
+                view_match_t match;
+                if (std::regex_search(distance_str.begin(), distance_str.end(), match, plate_no_regex)) {
+                    distance_t junction;
+                    int decimal = *match[2].first - '0';
+                    auto [end, error] = std::from_chars(&*match[1].first, &*match[1].second, junction);
+                    if (error == std::errc() && junction <= (std::numeric_limits<distance_t>::max() - decimal) / 10)
+                        return distance_t(junction * 10 + decimal);
+                }
+                return std::nullopt;
+            }
+        }
+
+        std::optional<road_t> parse_road(std::string_view road_str) {
+            if (options::regex_reference)
+                return reference::parse_road(road_str);
+            auto num = scanner::scan_road_num(road_str);
+            if (num)
+                return road_t(road_num_t(num.value()), road_str[0]);
             return std::nullopt;
         }
 
-        std::optional<distance_t> parse_distance(const std::string &distance_str) {
-            static const std::regex plate_no_regex(R"~(^(0|[1-9]\d*),(\d)$)~");
-            std::smatch match;
-            if (std::regex_search(distance_str, match, plate_no_regex)) {
-                std::string junction = match.str(1);
-                int decimal = match.str(2)[0] - '0';
-                try {
-                    return distance_t(std::stoi(junction) * 10 + decimal);
-                } catch (const std::out_of_range &e) {}
-            }
+        std::optional<distance_t> parse_distance(std::string_view distance_str) {
+            if (options::regex_reference)
+                return reference::parse_distance(distance_str);
+            auto distance = scanner::scan_distance(distance_str);
+            if (distance)
+                return distance_t(distance.value());
             return std::nullopt;
         }
     }
 
     namespace vehicle {
-        using plate_no_t = std::string;
-        using vehicle_t = std::tuple<plate_no_t>;
+        namespace reference {
+            std::optional<vehicle_ref_t> parse_vehicle(std::string_view plate_no_str) {
+                static const std::regex plate_no_regex(R"~(^[a-zA-Z0-9]{3,11}$)~");
+                if (std::regex_match(plate_no_str.begin(), plate_no_str.end(), plate_no_regex))
+                    return vehicle_ref_t(plate_no_str);
+                return std::nullopt;
+            }
+        }
 
-        std::optional<vehicle_t> parse_vehicle(const std::string &plate_no_str) {
-            static const std::regex plate_no_regex(R"~(^[a-zA-Z0-9]{3,11}$)~");
-            if (std::regex_match(plate_no_str, plate_no_regex))
-                return vehicle_t(plate_no_str);
+        std::optional<vehicle_ref_t> parse_vehicle(std::string_view plate_no_str) {
+            if (options::regex_reference)
+                return reference::parse_vehicle(plate_no_str);
+            if (scanner::is_plate_no(plate_no_str))
+                return vehicle_ref_t(plate_no_str);
             return std::nullopt;
         }
     }
 
-    namespace input {
-        using line_no_t = int;
-        using line_t = std::string;
-        using line_desc_t = std::tuple<line_no_t, line_t>;
-        using line_error_desc_t = line_desc_t;
+    // Splitting the input into lines and words, which the engine of nod.h has no use for.
+    namespace scanner {
+        // Vectorized scanning of whole registers: bit i of a mask is set when byte i of the register matches.
+        // space_mask matches ' ' and '\t' to '\r', the latter checked as an unsigned (c - '\t') <= 4.
+#if defined(__AVX2__)
+        constexpr size_t simd_width = 32;
+        using simd_mask_t = uint32_t;
+
+        simd_mask_t newline_mask(const char *data) {
+            auto bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data));
+            return simd_mask_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('\n'))));
+        }
+
+        simd_mask_t space_mask(const char *data) {
+            auto bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data));
+            auto shifted = _mm256_sub_epi8(bytes, _mm256_set1_epi8('\t'));
+            auto controls = _mm256_cmpeq_epi8(_mm256_max_epu8(shifted, _mm256_set1_epi8(4)), _mm256_set1_epi8(4));
+            auto spaces = _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(' '));
+            return simd_mask_t(_mm256_movemask_epi8(_mm256_or_si256(controls, spaces)));
+        }
+#elif defined(__SSE2__)
+        constexpr size_t simd_width = 16;
+        using simd_mask_t = uint32_t;
+
+        simd_mask_t newline_mask(const char *data) {
+            auto bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data));
+            return simd_mask_t(_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8('\n'))));
+        }
+
+        simd_mask_t space_mask(const char *data) {
+            auto bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data));
+            auto shifted = _mm_sub_epi8(bytes, _mm_set1_epi8('\t'));
+            auto controls = _mm_cmpeq_epi8(_mm_max_epu8(shifted, _mm_set1_epi8(4)), _mm_set1_epi8(4));
+            auto spaces = _mm_cmpeq_epi8(bytes, _mm_set1_epi8(' '));
+            return simd_mask_t(_mm_movemask_epi8(_mm_or_si128(controls, spaces)));
+        }
+#endif
+
+        const char *find_newline(const char *begin, const char *end) {
+#if defined(__SSE2__)
+            for (; end - begin >= ptrdiff_t(simd_width); begin += simd_width)
+                if (auto mask = newline_mask(begin))
+                    return begin + __builtin_ctz(mask);
+#endif
+            return std::find(begin, end, '\n');
+        }
+
+        size_t count_newlines(const char *begin, const char *end) {
+            size_t count = 0;
+#if defined(__SSE2__)
+            for (; end - begin >= ptrdiff_t(simd_width); begin += simd_width)
+                count += __builtin_popcount(newline_mask(begin));
+#endif
+            return count + std::count(begin, end, '\n');
+        }
+
+        // Finds the first byte that is a space when spaces is true, or not a space otherwise.
+        const char *find_space(const char *begin, const char *end, bool spaces) {
+#if defined(__SSE2__)
+            for (; end - begin >= ptrdiff_t(simd_width); begin += simd_width) {
+                auto mask = space_mask(begin);
+                if (!spaces)
+                    mask = ~mask & simd_mask_t((uint64_t(1) << simd_width) - 1);
+                if (mask)
+                    return begin + __builtin_ctz(mask);
+            }
+#endif
+            while (begin != end && is_space(*begin) != spaces)
+                begin++;
+            return begin;
+        }
+
+        // Cuts the first whitespace separated word off the front of rest. Returns an empty view
+        // when there are no more words. Words longer than max_length are cut after max_length + 1 bytes,
+        // which is enough for any validator to reject them without scanning the rest.
+        std::string_view next_word(std::string_view &rest, size_t max_length = std::string_view::npos) {
+            auto rest_end = rest.data() + rest.size();
+            auto begin = find_space(rest.data(), rest_end, false);
+            auto word_end = max_length < size_t(rest_end - begin) ? begin + max_length + 1 : rest_end;
+            auto end = find_space(begin, word_end, true);
+            std::string_view word(begin, end - begin);
+            rest.remove_prefix(end - rest.data());
+            return word;
+        }
+
+        // Only whitespace is left in rest.
+        bool at_end(std::string_view rest) {
+            return find_space(rest.data(), rest.data() + rest.size(), false) == rest.data() + rest.size();
+        }
+    }
+
+    namespace vehicle {
+        std::string_view plate_no_view(const plate_no_t &plate_no) {
+            auto length = std::find(plate_no.begin(), plate_no.end(), '\0') - plate_no.begin();
+            return std::string_view(plate_no.data(), length);
+        }
     }
 
+    // Queries, merges and stats of the state that only nod.cc answers.
     namespace toll_charging {
-        using road_type_data_t = std::map<road::road_type_t, road::distance_t>;
-        using vehicles_data_t = std::map<vehicle::vehicle_t, road_type_data_t>;
-        using roads_data_t = std::map<road::road_t, road::distance_t>;
-
-        using not_finished_entry_t = std::tuple<road::road_t, road::distance_t, input::line_desc_t>;
-        using not_finished_data_t = std::map<vehicle::vehicle_t, not_finished_entry_t>;
-
-        using state_t = std::tuple<vehicles_data_t, roads_data_t, not_finished_data_t>;
-
-        std::optional<input::line_error_desc_t> add_entry(state_t &state, const vehicle::vehicle_t &vehicle,
-                                                          const road::road_t &road, const road::distance_t &distance,
-                                                          const input::line_desc_t &line_desc) {
-            auto &not_finished = std::get<not_finished_data_t>(state);
-            std::optional<input::line_error_desc_t> error_line;
-            if (not_finished.count(vehicle)) {
-                auto it = not_finished.find(vehicle);
-                auto &[not_finished_road, start_distance, paired_line] = it->second;
-                if (not_finished_road == road) {
-                    auto traveled_distance = std::abs(distance - start_distance);
-                    auto &vehicles_data = std::get<vehicles_data_t>(state);
-                    auto &roads_data = std::get<roads_data_t>(state);
-                    roads_data[road] += traveled_distance;
-                    vehicles_data[vehicle][std::get<road::road_type_t>(road)] += traveled_distance;
-                    not_finished.erase(it);
-                    return std::nullopt;
-                } else
-                    error_line = paired_line;
+        // Clears the bucket of the next epoch, so it costs the same whatever the number of trips.
+        void end_epoch(road_window_t &window) {
+            auto &[buckets, epoch] = window;
+            epoch++;
+            if (!buckets.empty())
+                buckets[epoch % max_window] = roads_data_t();
+        }
+
+        // Total of the road over the current epoch and the length - 1 epochs before it, if any of them
+        // has a finished trip on it. length is at most max_window.
+        std::optional<road::total_distance_t> window_distance(const road_window_t &window, const road::road_t &road,
+                                                              size_t length) {
+            const auto &[buckets, epoch] = window;
+            std::optional<road::total_distance_t> total;
+            if (buckets.empty())
+                return total;
+            for (uint64_t back = 0; back < length && back <= epoch; back++) {
+                auto distance = find_road_data(buckets[(epoch - back) % max_window], road);
+                if (distance)
+                    total = total.value_or(0) + *distance;
+            }
+            return total;
+        }
+
+        // Adds the buckets of another window at the same epoch.
+        void merge_window(road_window_t &window, const road_window_t &other) {
+            auto &buckets = std::get<std::vector<roads_data_t>>(window);
+            const auto &other_buckets = std::get<std::vector<roads_data_t>>(other);
+            if (buckets.empty())
+                buckets.resize(other_buckets.size());
+            for (size_t bucket = 0; bucket < other_buckets.size(); bucket++)
+                for_each_road(other_buckets[bucket], [&](const road::road_t &road, road::total_distance_t distance) {
+                    add_road_distance(buckets[bucket], road, distance);
+                });
+        }
+
+        // Builds the heaps from the vehicle totals, for states that were not filled through add_entry.
+        void rebuild_top(state_t &state) {
+            const auto &vehicles_data = state.vehicles_data;
+            state.top_vehicles = top_vehicles_t();
+            for (vehicle::vehicle_id_t id = 0; id < vehicles_data.size(); id++)
+                for (size_t type = 0; type < road::road_types.size(); type++)
+                    if (std::get<uint8_t>(vehicles_data[id]) & (1 << type))
+                        update_top(state, type, id);
+        }
+
+        // Plate number and totals of a vehicle in a top list.
+        using ranked_vehicle_t = std::tuple<vehicle::plate_no_t, road_type_data_t>;
+
+        void add_top_vehicles(std::vector<ranked_vehicle_t> &ranked, const state_t &state, size_t type) {
+            const auto &table = state.table;
+            const auto &vehicles_data = state.vehicles_data;
+            for (auto id : std::get<0>(state.top_vehicles[type]))
+                ranked.emplace_back(vehicle::plate_no(table, id), vehicles_data[id]);
+        }
+
+        // Keeps the count vehicles ranked highest by their total on the road type, in rank order.
+        void rank_vehicles(std::vector<ranked_vehicle_t> &ranked, size_t type, size_t count) {
+            count = std::min(count, ranked.size());
+            std::partial_sort(ranked.begin(), ranked.begin() + count, ranked.end(),
+                              [type](const ranked_vehicle_t &lhs, const ranked_vehicle_t &rhs) {
+                                  return ranks_before(std::get<0>(std::get<road_type_data_t>(lhs))[type],
+                                                      std::get<vehicle::plate_no_t>(lhs),
+                                                      std::get<0>(std::get<road_type_data_t>(rhs))[type],
+                                                      std::get<vehicle::plate_no_t>(rhs));
+                              });
+            ranked.resize(count);
+        }
+
+        // Indexes of the count roads with the highest totals, in rank order. There are only road::road_slots
+        // roads, so they are ranked when asked for.
+        std::vector<size_t> top_roads(const roads_data_t &roads_data, size_t count) {
+            const auto &[distances, present] = roads_data;
+            std::vector<size_t> ranked;
+            for (size_t index = 0; index < road::road_slots; index++)
+                if (present.test(index))
+                    ranked.push_back(index);
+            count = std::min(count, ranked.size());
+            std::partial_sort(ranked.begin(), ranked.begin() + count, ranked.end(),
+                              [&distances](size_t lhs, size_t rhs) {
+                                  return distances[lhs] != distances[rhs] ? distances[lhs] > distances[rhs] : lhs < rhs;
+                              });
+            ranked.resize(count);
+            return ranked;
+        }
+
+        // Ids of vehicles with a finished trip, ordered by their plate numbers.
+        // Only the vehicles added since the previous call are sorted, then merged into the existing order.
+        const std::vector<vehicle::vehicle_id_t> &sorted_vehicles(state_t &state) {
+            const auto &table = state.table;
+            auto &[sorted, added] = state.vehicles_order;
+            if (!added.empty()) {
+                auto by_plate_no = [&table](vehicle::vehicle_id_t lhs, vehicle::vehicle_id_t rhs) {
+                    return vehicle::plate_no(table, lhs) < vehicle::plate_no(table, rhs);
+                };
+                std::sort(added.begin(), added.end(), by_plate_no);
+                auto middle = sorted.insert(sorted.end(), added.begin(), added.end());
+                std::inplace_merge(sorted.begin(), middle, sorted.end(), by_plate_no);
+                added.clear();
+            }
+            return sorted;
+        }
+
+        // Point in time copy of what a full dump prints: plate numbers and totals of the vehicles with a finished
+        // trip, in plate number order, and road totals.
+        using snapshot_t = std::tuple<vehicle::plates_t, vehicles_data_t, roads_data_t>;
+
+        snapshot_t take_snapshot(state_t &state) {
+            const auto &sorted = sorted_vehicles(state);
+            const auto &table = state.table;
+            const auto &vehicles_data = state.vehicles_data;
+            snapshot_t snapshot;
+            auto &[plates, sorted_data, roads_data] = snapshot;
+            plates.reserve(sorted.size());
+            sorted_data.reserve(sorted.size());
+            for (auto id : sorted) {
+                plates.push_back(vehicle::plate_no(table, id));
+                sorted_data.push_back(vehicles_data[id]);
             }
-            not_finished[vehicle] = not_finished_entry_t(road, distance, line_desc);
-            return error_line;
+            roads_data = state.roads_data;
+            return snapshot;
+        }
+
+        // Sizes of one or more states, the roads of all of them are counted once.
+        struct state_stats_t {
+            size_t plates = 0, vehicles = 0, pending = 0, stored_line_bytes = 0;
+            std::bitset<road::road_slots> roads;
+        };
+
+        void add_state_stats(state_stats_t &state_stats, const state_t &state) {
+            const auto &[sorted, added] = state.vehicles_order;
+            state_stats.plates += std::get<vehicle::plates_t>(state.table).size();
+            state_stats.vehicles += sorted.size() + added.size();
+            state_stats.pending += std::get<size_t>(state.not_finished);
+            state_stats.stored_line_bytes += state.line_arena.live;
+            state_stats.roads |= std::get<1>(state.roads_data);
         }
     }
+}
 
+namespace {
     namespace input {
-        using command_desc_t = std::tuple<std::optional<road::road_t>, std::optional<vehicle::vehicle_t>>;
-        using info_desc_t = std::tuple<vehicle::vehicle_t, road::road_t, road::distance_t>;
-
-        std::optional<command_desc_t> parse_command(const line_t &line) {
-            static const std::regex command_regex(R"~(^\s*\?\s*([^\s]*)\s*$)~");
-            std::smatch match;
-            if (std::regex_search(line, match, command_regex)) {
-                std::string arg = match.str(1);
-                if (arg.empty())
-                    return command_desc_t(std::nullopt, std::nullopt);
-                auto road = road::parse_road(arg);
-                auto vehicle = vehicle::parse_vehicle(arg);
-                if (!road && !vehicle)
-                    return std::nullopt;
-                return command_desc_t(road, vehicle);
+        using namespace nod::detail::input;
+
+        using command_desc_t = std::tuple<std::optional<road::road_t>, std::optional<vehicle::vehicle_ref_t>>;
+        using info_desc_t = std::tuple<vehicle::vehicle_ref_t, road::road_t, road::distance_t>;
+
+        std::optional<command_desc_t> command_with_arg(std::string_view arg) {
+            if (arg.empty())
+                return command_desc_t(std::nullopt, std::nullopt);
+            auto road = road::parse_road(arg);
+            auto vehicle = vehicle::parse_vehicle(arg);
+            if (!road && !vehicle)
+                return std::nullopt;
+            return command_desc_t(road, vehicle);
+        }
+
+        namespace reference {
+            std::optional<command_desc_t> parse_command(std::string_view line) {
+                static const std::regex command_regex(R"~(^\s*\?\s*([^\s]*)\s*$)~");
+                view_match_t match;
+                if (std::regex_search(line.begin(), line.end(), match, command_regex))
+                    return command_with_arg(line.substr(match[1].first - line.begin(), match[1].length()));
+                return std::nullopt;
             }
-            return std::nullopt;
         }
 
-        std::vector<std::string> split_args(const std::string &str) {
-            std::istringstream ss(str);
-            std::string word;
-            std::vector<std::string> result;
-            while (ss >> word)
-                result.emplace_back(std::move(word));
+        // Whitespace, '?', at most one word as the argument, and whitespace again.
+        std::optional<command_desc_t> parse_command(std::string_view line) {
+            if (options::regex_reference)
+                return reference::parse_command(line);
+            auto first = scanner::find_space(line.data(), line.data() + line.size(), false);
+            if (first == line.data() + line.size() || *first != '?')
+                return std::nullopt;
+            line.remove_prefix(first - line.data() + 1);
+            auto arg = scanner::next_word(line, scanner::max_plate_length);
+            if (!scanner::at_end(line))
+                return std::nullopt;
+            return command_with_arg(arg);
+        }
+
+        std::vector<std::string_view> split_args(std::string_view str) {
+            std::vector<std::string_view> result;
+            for (auto word = scanner::next_word(str); !word.empty(); word = scanner::next_word(str))
+                result.push_back(word);
             return result;
         }
 
-        std::optional<info_desc_t> parse_info(const line_t &line) {
+        // Only lines starting with '?' can be commands, and such lines are never valid info lines.
+        bool is_command_line(std::string_view line) {
+            auto first = std::find_if_not(line.begin(), line.end(), scanner::is_space);
+            return first != line.end() && *first == '?';
+        }
+
+        std::optional<info_desc_t> parse_info_reference(std::string_view line) {
             auto args = split_args(line);
             if (args.size() == 3) {
                 auto vehicle = vehicle::parse_vehicle(args[0]);
@@ -128,87 +846,1907 @@ namespace {
             return std::nullopt;
         }
 
-        using printable_distance_t = std::tuple<road::distance_t>;
+        // Single pass over the line: every word is validated as soon as it is found, and no word is scanned
+        // further than its longest valid length, so malformed lines are rejected after a few bytes.
+        std::optional<info_desc_t> parse_info(std::string_view line) {
+            if (options::regex_reference)
+                return parse_info_reference(line);
+            auto plate_no = scanner::next_word(line, scanner::max_plate_length);
+            if (!scanner::is_plate_no(plate_no))
+                return std::nullopt;
+            auto road_str = scanner::next_word(line, scanner::max_road_length);
+            auto road_num = scanner::scan_road_num(road_str);
+            if (!road_num)
+                return std::nullopt;
+            auto distance = scanner::scan_distance(scanner::next_word(line, scanner::max_distance_length));
+            if (!distance || !scanner::at_end(line))
+                return std::nullopt;
+            return info_desc_t(vehicle::vehicle_ref_t(plate_no),
+                               road::road_t(road::road_num_t(road_num.value()), road_str[0]),
+                               road::distance_t(distance.value()));
+        }
 
-        std::ostream &operator<<(std::ostream &stream, const printable_distance_t &printable_distance) {
-            auto distance = std::get<road::distance_t>(printable_distance);
-            return stream << distance / 10 << "," << distance % 10;
+        // The ?#stats command, with the same spacing rules as the other commands.
+        bool is_stats_command(std::string_view line) {
+            if (!stats::enabled || !is_command_line(line))
+                return false;
+            line.remove_prefix(line.find('?') + 1);
+            return scanner::next_word(line, 6) == "#stats" && scanner::at_end(line);
         }
 
-        std::ostream &operator<<(std::ostream &stream, const road::road_t &road) {
+        // A decimal number from 1 to max, without leading zeros.
+        std::optional<size_t> parse_count(std::string_view count_str, size_t max) {
+            size_t count = 0;
+            auto [end, error] = std::from_chars(count_str.data(), count_str.data() + count_str.size(), count);
+            if (count_str.empty() || count_str[0] == '0' || error != std::errc()
+                || end != count_str.data() + count_str.size() || count > max)
+                return std::nullopt;
+            return count;
+        }
+
+        // Road and number of epochs of the ?ROAD@N command.
+        using window_command_t = std::tuple<road::road_t, size_t>;
+
+        // The ?ROAD@N command for N from 1 to toll_charging::max_window, with the same spacing rules as the
+        // other commands.
+        std::optional<window_command_t> parse_window_command(std::string_view line) {
+            if (!is_command_line(line))
+                return std::nullopt;
+            line.remove_prefix(line.find('?') + 1);
+            auto arg = scanner::next_word(line, scanner::max_road_length + 3);
+            auto at = arg.find('@');
+            if (at == std::string_view::npos || !scanner::at_end(line))
+                return std::nullopt;
+            auto road = road::parse_road(arg.substr(0, at));
+            auto length = parse_count(arg.substr(at + 1), toll_charging::max_window);
+            if (!road || !length)
+                return std::nullopt;
+            return window_command_t(road.value(), length.value());
+        }
+
+        // Road type to rank vehicles by, or none to rank roads, and the number of them to print.
+        using top_command_t = std::tuple<std::optional<road::road_type_t>, size_t>;
+
+        // The ?#top A K, ?#top S K and ?#top roads K commands for K from 1 to toll_charging::max_top.
+        std::optional<top_command_t> parse_top_command(std::string_view line) {
+            if (!is_command_line(line))
+                return std::nullopt;
+            line.remove_prefix(line.find('?') + 1);
+            if (scanner::next_word(line, 4) != "#top")
+                return std::nullopt;
+            auto kind = scanner::next_word(line, 5);
+            auto count = parse_count(scanner::next_word(line, 4), toll_charging::max_top);
+            if (!count || !scanner::at_end(line))
+                return std::nullopt;
+            if (kind == "roads")
+                return top_command_t(std::nullopt, count.value());
+            if (kind.size() == 1 && std::count(road::road_types.begin(), road::road_types.end(), kind[0]))
+                return top_command_t(kind[0], count.value());
+            return std::nullopt;
+        }
+
+        struct empty_line_t {};
+        struct stats_command_t {};
+        struct invalid_line_t {};
+        using parsed_line_t = std::variant<empty_line_t, info_desc_t, command_desc_t, window_command_t,
+                                           top_command_t, stats_command_t, invalid_line_t>;
+        using record_t = std::tuple<line_desc_ref_t, parsed_line_t>;
+
+        // Classifies the line by its first non-space byte, then parses every field of it once.
+        parsed_line_t parse_line(std::string_view line) {
+            if (line.empty())
+                return empty_line_t();
+            if (is_command_line(line)) {
+                if (is_stats_command(line))
+                    return stats_command_t();
+                auto command = parse_command(line);
+                if (command)
+                    return command.value();
+                auto window_command = parse_window_command(line);
+                if (window_command)
+                    return window_command.value();
+                auto top_command = parse_top_command(line);
+                if (top_command)
+                    return top_command.value();
+            } else {
+                auto info = parse_info(line);
+                if (info)
+                    return info.value();
+            }
+            return invalid_line_t();
+        }
+
+        // Splits block into lines and appends them parsed to records, numbering them from first_line_no.
+        // A last line without the trailing '\n' counts as well. All views point into block.
+        void parse_block(std::string_view block, line_no_t first_line_no, std::pmr::vector<record_t> &records) {
+            auto begin = block.data(), end = block.data() + block.size();
+            for (auto line_no = first_line_no; begin != end; line_no++) {
+                auto line_end = scanner::find_newline(begin, end);
+                std::string_view line(begin, line_end - begin);
+                records.emplace_back(line_desc_ref_t(line_no, line), parse_line(line));
+                begin = line_end == end ? end : line_end + 1;
+            }
+        }
+
+        using printable_distance_t = std::tuple<road::total_distance_t>;
+
+        output::writer_t &operator<<(output::writer_t &stream, const printable_distance_t &printable_distance) {
+            auto distance = std::get<road::total_distance_t>(printable_distance);
+            return stream << distance / 10 << ',' << distance % 10;
+        }
+
+        output::writer_t &operator<<(output::writer_t &stream, const road::road_t &road) {
             return stream << std::get<road::road_type_t>(road) << std::get<road::road_num_t>(road);
         }
 
-        std::ostream &operator<<(std::ostream &stream, const vehicle::vehicle_t &vehicle) {
-            return stream << std::get<vehicle::plate_no_t>(vehicle);
+        output::writer_t &operator<<(output::writer_t &stream, const vehicle::plate_no_t &plate_no) {
+            return stream << vehicle::plate_no_view(plate_no);
         }
 
-        std::ostream &operator<<(std::ostream &stream, const toll_charging::road_type_data_t &entries) {
+        output::writer_t &operator<<(output::writer_t &stream, const toll_charging::road_type_data_t &entries) {
+            const auto &[distances, mask] = entries;
             const char *delimiter = "";
-            for (const auto &entry : entries) {
-                stream << delimiter << entry.first << " " << printable_distance_t(entry.second);
+            for (size_t index = 0; index < road::road_types.size(); index++) {
+                if (!(mask & (1 << index)))
+                    continue;
+                stream << delimiter << road::road_types[index] << " " << printable_distance_t(distances[index]);
                 delimiter = " ";
             }
             return stream;
         }
 
-        void print_error(const input::line_error_desc_t &error_line) {
-            std::cerr << "Error in line " << std::get<input::line_no_t>(error_line) << ": "
-                      << std::get<input::line_t>(error_line)
-                      << std::endl;
+        // Error reports beyond options::error_limit: how many, and the lowest and highest line number in them.
+        std::tuple<uint64_t, line_no_t, line_no_t> suppressed_errors;
+        uint64_t printed_errors = 0;
+
+        void print_error(const input::line_desc_ref_t &error_line) {
+            stats::add(stats::counters.error_reports, 1);
+            auto line_no = std::get<input::line_no_t>(error_line);
+            if (printed_errors == options::error_limit) {
+                auto &[count, first, last] = suppressed_errors;
+                first = count++ == 0 ? line_no : std::min(first, line_no);
+                last = std::max(last, line_no);
+                return;
+            }
+            printed_errors++;
+            output::err << "Error in line " << line_no << ": " << std::get<std::string_view>(error_line) << '\n';
+        }
+
+        // One line in place of all the error reports print_error left out.
+        void print_suppressed_errors() {
+            const auto &[count, first, last] = suppressed_errors;
+            if (count > 0)
+                output::err << "Errors: " << count << " more in lines " << first << " to " << last << " not printed\n";
+        }
+
+        template<typename PlateNo>
+        void print_vehicle(const PlateNo &plate_no, const toll_charging::road_type_data_t &entries) {
+            output::out << plate_no << " " << entries << '\n';
+        }
+
+        void print_road(const road::road_t &road, road::total_distance_t distance) {
+            output::out << road << " " << printable_distance_t(distance) << '\n';
+        }
+
+        // Ranks the vehicles by their total on the road type and prints the count highest.
+        void print_top_vehicles(std::vector<toll_charging::ranked_vehicle_t> &ranked, road::road_type_t road_type,
+                                size_t count) {
+            toll_charging::rank_vehicles(ranked, road::type_index(road_type), count);
+            for (const auto &[plate_no, entries] : ranked)
+                print_vehicle(plate_no, entries);
         }
 
-        bool handle_command(toll_charging::state_t &state, const input::line_desc_t &line_desc) {
-            auto cmd = input::parse_command(std::get<input::line_t>(line_desc));
-            if (!cmd) return false;
-            const auto &[cmd_road, cmd_vehicle] = cmd.value();
-            const auto &[vehicles_data, roads_data, _] = state;
+        void print_top_roads(const toll_charging::roads_data_t &roads_data, size_t count) {
+            for (auto index : toll_charging::top_roads(roads_data, count))
+                print_road(road::road_at(index), std::get<0>(roads_data)[index]);
+        }
+
+        void print_window(const window_command_t &command, road::total_distance_t distance) {
+            const auto &[road, length] = command;
+            output::out << road << '@' << length << " " << printable_distance_t(distance) << '\n';
+        }
+
+        // The answer to a command without arguments. Only writes to the output, so it can run on any thread
+        // that captures it.
+        void print_snapshot(const toll_charging::snapshot_t &snapshot) {
+            const auto &[plates, vehicles_data, roads_data] = snapshot;
+            for (size_t index = 0; index < plates.size(); index++)
+                print_vehicle(plates[index], vehicles_data[index]);
+            toll_charging::for_each_road(roads_data, print_road);
+        }
+
+        // Stored line bytes only count lines kept outside of the mapped input.
+        void print_stats(const toll_charging::state_stats_t &state_stats) {
+            const auto &counters = stats::counters;
+            auto elapsed_ns = stats::elapsed_ns(stats::start);
+            auto ingest_ns = elapsed_ns - std::min(elapsed_ns, counters.read_ns + counters.command_ns);
+            output::err << "Stats: " << counters.lines << " lines (" << counters.info_lines << " info, "
+                        << counters.command_lines << " commands, " << counters.invalid_lines << " invalid, "
+                        << counters.empty_lines << " empty), " << counters.error_reports << " error reports\n";
+            output::err << "Stats: " << counters.bytes_read << " bytes read, " << counters.bytes_written
+                        << " bytes written\n";
+            output::err << "Stats: " << state_stats.plates << " plates, " << state_stats.vehicles
+                        << " vehicles with trips, " << state_stats.pending << " pending entries, "
+                        << state_stats.roads.count() << " roads, " << state_stats.stored_line_bytes
+                        << " bytes of stored lines\n";
+            output::err << "Stats: " << elapsed_ns / 1000 << " us elapsed, " << counters.read_ns / 1000
+                        << " us reading, " << counters.command_ns / 1000 << " us in commands, "
+                        << counters.write_ns / 1000 << " us writing, "
+                        << ingest_ns / std::max<uint64_t>(counters.lines, 1) << " ns per line otherwise\n";
+            output::flush();
+        }
+
+        void print_stats(const toll_charging::state_t &state) {
+            toll_charging::state_stats_t state_stats;
+            toll_charging::add_state_stats(state_stats, state);
+            print_stats(state_stats);
+        }
+
+        void handle_command(toll_charging::state_t &state, const command_desc_t &command) {
+            stats::timer_t timer(stats::counters.command_ns);
+            const auto &[cmd_road, cmd_vehicle] = command;
+            const auto &table = state.table;
+            const auto &vehicles_data = state.vehicles_data;
+            const auto &roads_data = state.roads_data;
             if (!cmd_road && !cmd_vehicle) {
-                for (const auto &entry : vehicles_data)
-                    std::cout << entry.first << " " << entry.second << std::endl;
-                for (const auto &entry : roads_data)
-                    std::cout << entry.first << " " << printable_distance_t(entry.second) << std::endl;
+                for (auto id : toll_charging::sorted_vehicles(state))
+                    print_vehicle(vehicle::plate_no(table, id), vehicles_data[id]);
+                toll_charging::for_each_road(roads_data, print_road);
             }
             if (cmd_vehicle) {
-                auto it = vehicles_data.find(cmd_vehicle.value());
-                if (it != vehicles_data.end())
-                    std::cout << it->first << " " << it->second << std::endl;
+                auto entries = toll_charging::find_vehicle_data(state, cmd_vehicle.value());
+                if (entries)
+                    print_vehicle(std::get<std::string_view>(cmd_vehicle.value()), *entries);
             }
             if (cmd_road) {
-                auto it = roads_data.find(cmd_road.value());
-                if (it != roads_data.end())
-                    std::cout << it->first << " " << printable_distance_t(it->second) << std::endl;
+                auto distance = toll_charging::find_road_data(roads_data, cmd_road.value());
+                if (distance)
+                    print_road(cmd_road.value(), *distance);
             }
-            return true;
+            toll_charging::end_epoch(state.road_window);
+            output::answers_pending = true;
+        }
+
+        void handle_window_command(toll_charging::state_t &state, const window_command_t &command) {
+            stats::timer_t timer(stats::counters.command_ns);
+            auto &window = state.road_window;
+            const auto &[road, length] = command;
+            auto distance = toll_charging::window_distance(window, road, length);
+            if (distance)
+                print_window(command, *distance);
+            toll_charging::end_epoch(window);
+            output::answers_pending = true;
         }
 
-        bool handle_info(toll_charging::state_t &state, const input::line_desc_t &line_desc) {
-            auto info = input::parse_info(std::get<input::line_t>(line_desc));
-            if (!info) return false;
-            const auto &[vehicle, road, distance] = info.value();
+        void handle_top_command(toll_charging::state_t &state, const top_command_t &command) {
+            stats::timer_t timer(stats::counters.command_ns);
+            const auto &[road_type, count] = command;
+            if (road_type) {
+                std::vector<toll_charging::ranked_vehicle_t> ranked;
+                toll_charging::add_top_vehicles(ranked, state, road::type_index(road_type.value()));
+                print_top_vehicles(ranked, road_type.value(), count);
+            } else
+                print_top_roads(state.roads_data, count);
+            output::answers_pending = true;
+        }
+
+        // Lines whose answers are flushed together with those of the following commands.
+        bool is_query(const parsed_line_t &parsed_line) {
+            return std::holds_alternative<command_desc_t>(parsed_line)
+                   || std::holds_alternative<window_command_t>(parsed_line)
+                   || std::holds_alternative<top_command_t>(parsed_line);
+        }
+
+        void handle_info(toll_charging::state_t &state, const input::line_desc_ref_t &line_desc,
+                         const info_desc_t &info) {
+            const auto &[vehicle, road, distance] = info;
             auto error_line = toll_charging::add_entry(state, vehicle, road, distance, line_desc);
             if (error_line)
-                print_error(error_line.value());
+                print_error(std::get<input::line_error_desc_t>(error_line.value()));
+        }
+
+        // What is done with each kind of line when there is a single state. Modes that keep their state
+        // differently or answer some commands differently replace the matching members.
+        struct state_handlers_t {
+            toll_charging::state_t &state;
+
+            void info(const line_desc_ref_t &line_desc, const info_desc_t &info) {
+                handle_info(state, line_desc, info);
+            }
+
+            void command(const command_desc_t &command) {
+                handle_command(state, command);
+            }
+
+            void command(const window_command_t &command) {
+                handle_window_command(state, command);
+            }
+
+            void command(const top_command_t &command) {
+                handle_top_command(state, command);
+            }
+
+            void command(stats_command_t) {
+                print_stats(state);
+            }
+        };
+
+        // Counts the line by its kind and hands it to the matching member of handlers, see state_handlers_t.
+        // Every mode handles its lines through here, so a new kind of line only needs its handlers. Everything
+        // printed meanwhile goes to sink when it is set.
+        template<typename Handlers>
+        void dispatch(Handlers &&handlers, const line_desc_ref_t &line_desc, const parsed_line_t &parsed_line,
+                      std::string *sink = nullptr) {
+            auto captured = std::exchange(output::captured, sink);
+            std::visit([&](const auto &line) {
+                using line_t = std::decay_t<decltype(line)>;
+                if constexpr (std::is_same_v<line_t, info_desc_t>) {
+                    stats::add(stats::counters.info_lines, 1);
+                    handlers.info(line_desc, line);
+                } else if constexpr (std::is_same_v<line_t, empty_line_t>)
+                    stats::add(stats::counters.empty_lines, 1);
+                else if constexpr (std::is_same_v<line_t, invalid_line_t>) {
+                    stats::add(stats::counters.invalid_lines, 1);
+                    print_error(line_desc);
+                } else {
+                    stats::add(stats::counters.command_lines, 1);
+                    handlers.command(line);
+                }
+            }, parsed_line);
+            output::captured = captured;
+        }
+
+        void handle_line(toll_charging::state_t &state, const input::line_desc_ref_t &line_desc) {
+            auto parsed_line = parse_line(std::get<std::string_view>(line_desc));
+            if (!is_query(parsed_line))
+                output::flush_answers();
+            dispatch(state_handlers_t{state}, line_desc, parsed_line);
+        }
+
+        constexpr size_t read_chunk_size = 1 << 20;
+
+        // Calls handle_line for every line read from source, in large chunks that are split in place. When
+        // available tells that the next read would wait for more input, idle is called first, and once more
+        // after the last line.
+        template<typename Idle, typename Handler>
+        void split_lines(const decompress::source_t &source, const std::function<bool()> &available, Idle &&idle,
+                         Handler &&handle_line) {
+            std::vector<char> buffer(read_chunk_size);
+            size_t begin = 0, filled = 0;
+            while (true) {
+                if (filled == buffer.size()) {
+                    if (begin > 0) {
+                        std::copy(buffer.begin() + begin, buffer.begin() + filled, buffer.begin());
+                        filled -= begin;
+                        begin = 0;
+                    } else
+                        buffer.resize(buffer.size() * 2);
+                }
+                if (!available())
+                    idle();
+                // Whatever was printed so far has to show up before waiting for more input.
+                output::flush();
+                ssize_t count;
+                {
+                    stats::timer_t timer(stats::counters.read_ns);
+                    count = source(buffer.data() + filled, buffer.size() - filled);
+                }
+                if (count < 0 && errno == EINTR)
+                    continue;
+                if (count <= 0)
+                    break;
+                stats::add(stats::counters.bytes_read, count);
+                size_t scanned = filled;
+                filled += count;
+                auto buffer_end = buffer.data() + filled;
+                for (auto it = scanner::find_newline(buffer.data() + scanned, buffer_end);
+                     it != buffer_end; it = scanner::find_newline(it + 1, buffer_end)) {
+                    size_t end = it - buffer.data();
+                    handle_line(std::string_view(buffer.data() + begin, end - begin));
+                    begin = end + 1;
+                }
+                if (begin == filled)
+                    begin = filled = 0;
+            }
+            if (begin < filled)
+                handle_line(std::string_view(buffer.data() + begin, filled - begin));
+            // Also at the end, so whatever idle prints comes before a report of corrupt input.
+            idle();
+        }
+
+        // Calls handle_line for every line of fd, without the trailing '\n'. An uncompressed regular file is
+        // mapped into memory as a whole and becomes mapped_input, which the caller unmaps once done with it.
+        // Anything else is read through split_lines, and compressed input is inflated first. idle is called
+        // before waiting for more input, with all lines read so far handled. Fails when the input is compressed
+        // in an unsupported format or corrupt.
+        template<typename Handler, typename Idle>
+        bool for_each_line(int fd, std::string_view &mapped_input, Handler &&handle_line, Idle &&idle) {
+            struct stat file_stat{};
+            bool mappable = fstat(fd, &file_stat) == 0 && S_ISREG(file_stat.st_mode) && file_stat.st_size > 0
+                            && lseek(fd, 0, SEEK_CUR) == 0;
+            if (mappable) {
+                char magic[decompress::magic_size];
+                auto magic_size = std::max<ssize_t>(pread(fd, magic, sizeof(magic), 0), 0);
+                mappable = decompress::detect(std::string_view(magic, magic_size)) == decompress::format_t::none;
+            }
+            if (mappable) {
+                size_t size = file_stat.st_size;
+                void *data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (data != MAP_FAILED) {
+                    madvise(data, size, MADV_SEQUENTIAL);
+                    mapped_input = std::string_view(static_cast<const char *>(data), size);
+                    stats::add(stats::counters.bytes_read, size);
+                    auto rest = mapped_input;
+                    while (!rest.empty()) {
+                        size_t end = scanner::find_newline(rest.data(), rest.data() + rest.size()) - rest.data();
+                        handle_line(rest.substr(0, end));
+                        rest.remove_prefix(std::min(end + 1, rest.size()));
+                    }
+                    return true;
+                }
+            }
+
+            std::string head;
+            while (head.empty() || decompress::undecided(head)) {
+                char byte;
+                ssize_t count = read(fd, &byte, 1);
+                if (count < 0 && errno == EINTR)
+                    continue;
+                if (count <= 0)
+                    break;
+                head.push_back(byte);
+            }
+            // The bytes read to recognize the format come first.
+            decompress::source_t source = [fd, head](char *data, size_t size) mutable -> ssize_t {
+                if (head.empty())
+                    return read(fd, data, size);
+                size = std::min(size, head.size());
+                std::memcpy(data, head.data(), size);
+                head.erase(0, size);
+                return ssize_t(size);
+            };
+            auto format = decompress::detect(head);
+            if (format == decompress::format_t::none) {
+                auto available = [fd]() {
+                    pollfd request{fd, POLLIN, 0};
+                    return poll(&request, 1, 0) > 0;
+                };
+                split_lines(source, available, idle, handle_line);
+                return true;
+            }
+            if (!decompress::supported(format)) {
+                output::err << "Compressed input is not supported in this build\n";
+                return false;
+            }
+#if defined(NOD_ZLIB)
+            decompress::inflater_t inflater(std::move(source));
+            split_lines([&inflater](char *data, size_t size) { return inflater.read(data, size); },
+                        [&inflater]() { return inflater.available(); }, idle, handle_line);
+            if (inflater.failed()) {
+                output::err << "Corrupt compressed input\n";
+                return false;
+            }
+#endif
             return true;
         }
 
-        void handle_all() {
-            toll_charging::state_t state;
-            line_no_t line_no = 0;
-            line_t line;
-            while (std::getline(std::cin, line)) {
+        template<typename Handler>
+        bool for_each_line(int fd, std::string_view &mapped_input, Handler &&handle_line) {
+            return for_each_line(fd, mapped_input, handle_line, []() {});
+        }
+
+        // Numbers lines from line_no + 1, and leaves line_no at the number of the last line. A mapped input
+        // becomes the mapped_input of the state. Fails like for_each_line, after the lines that could be read
+        // are handled.
+        bool handle_all(toll_charging::state_t &state, line_no_t &line_no) {
+            bool read = for_each_line(STDIN_FILENO, state.mapped_input, [&](std::string_view line) {
+                line_no++;
+                stats::add(stats::counters.lines, 1);
+                handle_line(state, line_desc_ref_t(line_no, line));
+            });
+            if (options::stats_at_exit)
+                print_stats(state);
+            return read;
+        }
+    }
+
+    // Parallel version of input::handle_all. Lines are collected into batches that end before every
+    // command and before waiting for more input. Workers first parse a batch in parallel, then apply its
+    // info lines to shards of the state chosen by the plate number hash, so all entries of a vehicle are
+    // applied in order by one worker. Errors are printed in line order afterwards, and commands are
+    // answered from all shards together.
+    namespace pipeline {
+        constexpr size_t max_batch_lines = 1 << 16;
+
+        // Runs a task on every worker at once. Worker 0 is the calling thread.
+        class workers_t {
+        public:
+            explicit workers_t(size_t count) {
+                for (size_t worker = 1; worker < count; worker++)
+                    threads.emplace_back([this, worker]() { loop(worker); });
+            }
+
+            ~workers_t() {
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    stopping = true;
+                }
+                started.notify_all();
+                for (auto &thread : threads)
+                    thread.join();
+            }
+
+            size_t size() const {
+                return threads.size() + 1;
+            }
+
+            void run(const std::function<void(size_t)> &new_task) {
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    task = &new_task;
+                    running = threads.size();
+                    generation++;
+                }
+                started.notify_all();
+                new_task(0);
+                std::unique_lock<std::mutex> lock(mutex);
+                finished.wait(lock, [this]() { return running == 0; });
+            }
+
+        private:
+            void loop(size_t worker) {
+                size_t seen_generation = 0;
+                while (true) {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    started.wait(lock, [&]() { return stopping || generation != seen_generation; });
+                    if (stopping)
+                        return;
+                    seen_generation = generation;
+                    lock.unlock();
+                    (*task)(worker);
+                    lock.lock();
+                    if (--running == 0)
+                        finished.notify_one();
+                }
+            }
+
+            std::vector<std::thread> threads;
+            std::mutex mutex;
+            std::condition_variable started, finished;
+            const std::function<void(size_t)> *task = nullptr;
+            size_t generation = 0, running = 0;
+            bool stopping = false;
+        };
+
+        // Number of the first line, the lines each followed by '\n', and the number of lines.
+        using batch_t = std::tuple<input::line_no_t, std::string, size_t>;
+        using shards_t = std::vector<toll_charging::state_t>;
+        // Line at which the error is reported, and the line that is reported.
+        using shard_error_t = std::tuple<input::line_no_t, input::line_error_desc_t>;
+
+        size_t shard_of(const shards_t &shards, const vehicle::vehicle_ref_t &vehicle) {
+            return vehicle::plate_no_hash()(vehicle::to_plate_no(vehicle)) % shards.size();
+        }
+
+        // All temporaries of a batch come from the per worker arenas.
+        void process_batch(workers_t &workers, shards_t &shards, std::vector<memory::arena_t> &arenas, batch_t &batch) {
+            for (auto &arena : arenas)
+                arena.reset();
+            auto &[first_line_no, bytes, line_count] = batch;
+            // One block of whole lines for every worker.
+            std::pmr::vector<std::tuple<std::string_view, input::line_no_t>> blocks(arenas[0].resource());
+            std::string_view rest(bytes);
+            auto line_no = first_line_no;
+            for (size_t worker = 0; worker < workers.size(); worker++) {
+                size_t cut = std::min(rest.size(), bytes.size() / workers.size() + 1);
+                if (cut > 0)
+                    cut = scanner::find_newline(rest.data() + cut - 1, rest.data() + rest.size()) - rest.data() + 1;
+                auto block = rest.substr(0, cut);
+                blocks.emplace_back(block, line_no);
+                line_no += scanner::count_newlines(block.data(), block.data() + block.size());
+                rest.remove_prefix(cut);
+            }
+
+            std::vector<std::pmr::vector<input::record_t>> records;
+            std::vector<std::pmr::vector<size_t>> record_shards;
+            std::vector<std::pmr::vector<shard_error_t>> shard_errors;
+            for (auto &arena : arenas) {
+                records.emplace_back(arena.resource());
+                record_shards.emplace_back(arena.resource());
+                shard_errors.emplace_back(arena.resource());
+            }
+            workers.run([&](size_t worker) {
+                const auto &[block, block_line_no] = blocks[worker];
+                input::parse_block(block, block_line_no, records[worker]);
+                for (const auto &[line_desc, parsed_line] : records[worker]) {
+                    auto info = std::get_if<input::info_desc_t>(&parsed_line);
+                    auto shard = info ? shard_of(shards, std::get<vehicle::vehicle_ref_t>(*info)) : 0;
+                    record_shards[worker].push_back(shard);
+                }
+            });
+
+            workers.run([&](size_t shard) {
+                for (size_t worker = 0; worker < records.size(); worker++)
+                    for (size_t index = 0; index < records[worker].size(); index++) {
+                        const auto &[line_desc, parsed_line] = records[worker][index];
+                        auto info = std::get_if<input::info_desc_t>(&parsed_line);
+                        if (!info || record_shards[worker][index] != shard)
+                            continue;
+                        const auto &[vehicle, road, distance] = *info;
+                        auto error_line = toll_charging::add_entry(shards[shard], vehicle, road, distance, line_desc);
+                        if (error_line)
+                            shard_errors[shard].emplace_back(std::get<input::line_no_t>(line_desc),
+                                                             std::get<input::line_error_desc_t>(error_line.value()));
+                    }
+            });
+
+            std::pmr::vector<shard_error_t> errors(arenas[0].resource());
+            for (const auto &shard_error : shard_errors)
+                errors.insert(errors.end(), shard_error.begin(), shard_error.end());
+            std::sort(errors.begin(), errors.end(), [](const shard_error_t &lhs, const shard_error_t &rhs) {
+                return std::get<input::line_no_t>(lhs) < std::get<input::line_no_t>(rhs);
+            });
+            auto error = errors.begin();
+            for (const auto &worker_records : records)
+                for (const auto &[line_desc, parsed_line] : worker_records) {
+                    bool info = std::holds_alternative<input::info_desc_t>(parsed_line);
+                    bool empty = std::holds_alternative<input::empty_line_t>(parsed_line);
+                    stats::add(info ? stats::counters.info_lines
+                                    : empty ? stats::counters.empty_lines : stats::counters.invalid_lines, 1);
+                    if (!info && !empty)
+                        input::print_error(line_desc);
+                    else if (error != errors.end()
+                             && std::get<input::line_no_t>(*error) == std::get<input::line_no_t>(line_desc))
+                        input::print_error(std::get<input::line_error_desc_t>(*error++));
+                }
+            bytes.clear();
+            line_count = 0;
+        }
+
+        toll_charging::roads_data_t merged_roads_data(const shards_t &shards) {
+            toll_charging::roads_data_t merged;
+            for (const auto &shard : shards)
+                toll_charging::for_each_road(shard.roads_data,
+                                             [&merged](const road::road_t &road, road::total_distance_t distance) {
+                                                 toll_charging::add_road_distance(merged, road, distance);
+                                             });
+            return merged;
+        }
+
+        // Calls handle_vehicle(plate_no, entries) for the vehicles of all shards, merged in plate number order.
+        // A plate number found in several shards is handled once for each of them, in shard order.
+        template<typename Handler>
+        void for_each_vehicle(shards_t &shards, Handler &&handle_vehicle) {
+            std::vector<const std::vector<vehicle::vehicle_id_t> *> sorted;
+            std::vector<size_t> positions(shards.size());
+            for (auto &shard : shards)
+                sorted.push_back(&toll_charging::sorted_vehicles(shard));
+            auto head_plate_no = [&](size_t shard) -> const vehicle::plate_no_t & {
+                const auto &table = shards[shard].table;
+                return vehicle::plate_no(table, (*sorted[shard])[positions[shard]]);
+            };
+            while (true) {
+                std::optional<size_t> next;
+                for (size_t shard = 0; shard < shards.size(); shard++)
+                    if (positions[shard] < sorted[shard]->size()
+                        && (!next || head_plate_no(shard) < head_plate_no(*next)))
+                        next = shard;
+                if (!next)
+                    return;
+                auto id = (*sorted[*next])[positions[*next]];
+                handle_vehicle(head_plate_no(*next), shards[*next].vehicles_data[id]);
+                positions[*next]++;
+            }
+        }
+
+        void print_vehicles(shards_t &shards) {
+            for_each_vehicle(shards, input::print_vehicle<vehicle::plate_no_t>);
+        }
+
+        void print_stats(const shards_t &shards) {
+            toll_charging::state_stats_t state_stats;
+            for (const auto &shard : shards)
+                toll_charging::add_state_stats(state_stats, shard);
+            input::print_stats(state_stats);
+        }
+
+        void handle_command(shards_t &shards, const input::command_desc_t &command) {
+            stats::timer_t timer(stats::counters.command_ns);
+            const auto &[cmd_road, cmd_vehicle] = command;
+            if (!cmd_road && !cmd_vehicle) {
+                print_vehicles(shards);
+                toll_charging::for_each_road(merged_roads_data(shards), input::print_road);
+            }
+            if (cmd_vehicle) {
+                auto &shard = shards[shard_of(shards, cmd_vehicle.value())];
+                auto entries = toll_charging::find_vehicle_data(shard, cmd_vehicle.value());
+                if (entries)
+                    input::print_vehicle(std::get<std::string_view>(cmd_vehicle.value()), *entries);
+            }
+            if (cmd_road) {
+                auto roads_data = merged_roads_data(shards);
+                auto distance = toll_charging::find_road_data(roads_data, cmd_road.value());
+                if (distance)
+                    input::print_road(cmd_road.value(), *distance);
+            }
+            for (auto &shard : shards)
+                toll_charging::end_epoch(shard.road_window);
+            output::answers_pending = true;
+        }
+
+        void handle_window_command(shards_t &shards, const input::window_command_t &command) {
+            stats::timer_t timer(stats::counters.command_ns);
+            const auto &[road, length] = command;
+            std::optional<road::total_distance_t> total;
+            for (auto &shard : shards) {
+                auto &window = shard.road_window;
+                auto distance = toll_charging::window_distance(window, road, length);
+                if (distance)
+                    total = total.value_or(0) + *distance;
+                toll_charging::end_epoch(window);
+            }
+            if (total)
+                input::print_window(command, *total);
+            output::answers_pending = true;
+        }
+
+        // Vehicles are in exactly one shard each, so the top of all of them is among the tops of the shards.
+        void handle_top_command(shards_t &shards, const input::top_command_t &command) {
+            stats::timer_t timer(stats::counters.command_ns);
+            const auto &[road_type, count] = command;
+            if (road_type) {
+                std::vector<toll_charging::ranked_vehicle_t> ranked;
+                for (const auto &shard : shards)
+                    toll_charging::add_top_vehicles(ranked, shard, road::type_index(road_type.value()));
+                input::print_top_vehicles(ranked, road_type.value(), count);
+            } else
+                input::print_top_roads(merged_roads_data(shards), count);
+            output::answers_pending = true;
+        }
+
+        // Lines handled one at a time, outside of batches, go to the shard of their vehicle.
+        struct shard_handlers_t {
+            shards_t &shards;
+
+            void info(const input::line_desc_ref_t &line_desc, const input::info_desc_t &info) {
+                input::handle_info(shards[shard_of(shards, std::get<vehicle::vehicle_ref_t>(info))], line_desc, info);
+            }
+
+            void command(const input::command_desc_t &command) {
+                handle_command(shards, command);
+            }
+
+            void command(const input::window_command_t &command) {
+                handle_window_command(shards, command);
+            }
+
+            void command(const input::top_command_t &command) {
+                handle_top_command(shards, command);
+            }
+
+            void command(input::stats_command_t) {
+                print_stats(shards);
+            }
+        };
+
+        bool handle_all(size_t threads) {
+            workers_t workers(threads);
+            shards_t shards(threads);
+            std::vector<memory::arena_t> arenas(threads);
+            batch_t batch;
+            input::line_no_t line_no = 0;
+            // Batches copy their lines, so no state points into a mapped input.
+            std::string_view mapped_input;
+            bool read = input::for_each_line(STDIN_FILENO, mapped_input, [&](std::string_view line) {
                 line_no++;
-                line_desc_t line_desc(line_no, line);
-                if (line.empty() || handle_command(state, line_desc) || handle_info(state, line_desc))
+                stats::add(stats::counters.lines, 1);
+                auto &[first_line_no, bytes, line_count] = batch;
+                if (input::is_command_line(line)) {
+                    process_batch(workers, shards, arenas, batch);
+                    input::dispatch(shard_handlers_t{shards}, input::line_desc_ref_t(line_no, line),
+                                    input::parse_line(line));
+                    return;
+                }
+                output::flush_answers();
+                if (line_count++ == 0)
+                    first_line_no = line_no;
+                bytes.append(line);
+                bytes.push_back('\n');
+                if (line_count == max_batch_lines)
+                    process_batch(workers, shards, arenas, batch);
+            }, [&]() {
+                // Errors of the lines read so far are printed before waiting, as without threads.
+                process_batch(workers, shards, arenas, batch);
+            });
+            process_batch(workers, shards, arenas, batch);
+            if (!mapped_input.empty())
+                munmap(const_cast<char *>(mapped_input.data()), mapped_input.size());
+            if (options::stats_at_exit)
+                print_stats(shards);
+            return read;
+        }
+    }
+
+    // Ingest of several input files at once, for example one log per toll region, each on its own thread
+    // with its own state. Lines are numbered as if the files were concatenated. The states are then merged
+    // into one, and stdin is handled as usual on top of it. Errors are printed in line order after the merge.
+    //
+    // Entries still pending at the end of a file are replayed into the merged state in line order. An entry
+    // left open at the end of one file is thus paired with an open entry of the same vehicle on the same
+    // road in a later file, as a trip crossing regions, and is reported as unpaired otherwise. Commands
+    // are only read from stdin; command lines in the files are reported as invalid.
+    namespace regions {
+        std::optional<std::string_view> map_file(int fd) {
+            struct stat file_stat{};
+            std::optional<std::string_view> bytes;
+            if (fstat(fd, &file_stat) == 0 && S_ISREG(file_stat.st_mode)) {
+                void *data = file_stat.st_size > 0
+                             ? mmap(nullptr, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : nullptr;
+                if (!data)
+                    bytes = std::string_view();
+                else if (data != MAP_FAILED) {
+                    madvise(data, file_stat.st_size, MADV_SEQUENTIAL);
+                    bytes = std::string_view(static_cast<const char *>(data), file_stat.st_size);
+                }
+            }
+            return bytes;
+        }
+
+        // Maps an uncompressed file into memory and adds it to mapped. A compressed one is inflated into a
+        // string of inflated instead, as the lines of every file are counted before any of them is ingested.
+        // Prints why a file cannot be read, with the messages of compressed stdin.
+        std::optional<std::string_view> read_file(const char *path, std::vector<std::string_view> &mapped,
+                                                  [[maybe_unused]] std::deque<std::string> &inflated) {
+            int fd = open(path, O_RDONLY);
+            if (fd < 0) {
+                output::err << "Cannot read input: " << std::string_view(path) << '\n';
+                return std::nullopt;
+            }
+            char magic[decompress::magic_size];
+            auto magic_size = std::max<ssize_t>(pread(fd, magic, sizeof(magic), 0), 0);
+            auto format = decompress::detect(std::string_view(magic, magic_size));
+            std::optional<std::string_view> bytes;
+            if (format == decompress::format_t::none) {
+                bytes = map_file(fd);
+                if (bytes && !bytes->empty())
+                    mapped.push_back(bytes.value());
+                else if (!bytes)
+                    output::err << "Cannot read input: " << std::string_view(path) << '\n';
+            } else if (!decompress::supported(format))
+                output::err << "Compressed input is not supported in this build: " << std::string_view(path) << '\n';
+#if defined(NOD_ZLIB)
+            else {
+                decompress::inflater_t inflater([fd](char *data, size_t size) { return read(fd, data, size); });
+                auto &file = inflated.emplace_back();
+                std::vector<char> chunk(input::read_chunk_size);
+                for (ssize_t count; (count = inflater.read(chunk.data(), chunk.size())) > 0;)
+                    file.append(chunk.data(), count);
+                if (inflater.failed())
+                    output::err << "Corrupt compressed input: " << std::string_view(path) << '\n';
+                else
+                    bytes = file;
+            }
+#endif
+            close(fd);
+            return bytes;
+        }
+
+        input::line_no_t count_lines(std::string_view bytes) {
+            auto newlines = scanner::count_newlines(bytes.data(), bytes.data() + bytes.size());
+            return input::line_no_t(newlines + (!bytes.empty() && bytes.back() != '\n'));
+        }
+
+        // Applies the info lines of one file, whose first line has number first_line_no, to state.
+        void ingest(std::string_view bytes, input::line_no_t first_line_no, toll_charging::state_t &state,
+                    std::vector<pipeline::shard_error_t> &errors, stats::counters_t &counters) {
+            auto begin = bytes.data(), end = bytes.data() + bytes.size();
+            for (auto line_no = first_line_no; begin != end; line_no++) {
+                auto line_end = scanner::find_newline(begin, end);
+                input::line_desc_ref_t line_desc(line_no, std::string_view(begin, line_end - begin));
+                begin = line_end == end ? end : line_end + 1;
+                stats::add(counters.lines, 1);
+                auto parsed_line = input::parse_line(std::get<std::string_view>(line_desc));
+                if (auto info = std::get_if<input::info_desc_t>(&parsed_line)) {
+                    stats::add(counters.info_lines, 1);
+                    const auto &[vehicle, road, distance] = *info;
+                    auto error_line = toll_charging::add_entry(state, vehicle, road, distance, line_desc);
+                    if (error_line)
+                        errors.emplace_back(line_no, std::get<input::line_error_desc_t>(error_line.value()));
+                } else if (std::holds_alternative<input::empty_line_t>(parsed_line))
+                    stats::add(counters.empty_lines, 1);
+                else {
+                    stats::add(counters.invalid_lines, 1);
+                    errors.emplace_back(line_no, line_desc);
+                }
+            }
+        }
+
+        // Finished trips are summed per plate number, and the merged ids are handed out in plate number
+        // order, so the merged order needs no sorting. Pending entries are replayed afterwards.
+        void merge(pipeline::shards_t &states, toll_charging::state_t &merged,
+                   std::vector<pipeline::shard_error_t> &errors) {
+            auto &table = merged.table;
+            auto &vehicles_data = merged.vehicles_data;
+            auto &sorted = merged.vehicles_order.sorted;
+            pipeline::for_each_vehicle(states, [&](const vehicle::plate_no_t &plate_no,
+                                                   const toll_charging::road_type_data_t &entries) {
+                auto id = vehicle::intern(table, vehicle::vehicle_ref_t(vehicle::plate_no_view(plate_no)));
+                if (id == vehicles_data.size()) {
+                    vehicles_data.emplace_back();
+                    sorted.push_back(id);
+                }
+                const auto &[distances, mask] = entries;
+                for (size_t index = 0; index < road::road_types.size(); index++)
+                    if (mask & (1 << index))
+                        toll_charging::add_type_distance(vehicles_data[id], road::road_types[index], distances[index]);
+            });
+            toll_charging::rebuild_top(merged);
+            merged.roads_data = pipeline::merged_roads_data(states);
+            for (const auto &state : states)
+                toll_charging::merge_window(merged.road_window,
+                                            state.road_window);
+
+            // Line number, state and slot of every pending entry.
+            std::vector<std::tuple<input::line_no_t, size_t, const toll_charging::not_finished_slot_t *>> pending;
+            for (size_t index = 0; index < states.size(); index++)
+                for (const auto &slot : std::get<0>(states[index].not_finished))
+                    if (std::get<vehicle::vehicle_id_t>(slot) != toll_charging::no_vehicle) {
+                        const auto &source = std::get<toll_charging::stored_source_t>(
+                                std::get<toll_charging::not_finished_entry_t>(slot));
+                        auto line_no = std::get<input::line_no_t>(std::get<input::stored_line_t>(source));
+                        pending.emplace_back(line_no, index, &slot);
+                    }
+            std::sort(pending.begin(), pending.end());
+            for (const auto &[line_no, index, slot] : pending) {
+                const auto &[id, entry] = *slot;
+                const auto &[road, distance, source] = entry;
+                const auto &plate_no = vehicle::plate_no(states[index].table, id);
+                vehicle::vehicle_ref_t vehicle(vehicle::plate_no_view(plate_no));
+                auto line_desc = toll_charging::load_line(states[index], std::get<input::stored_line_t>(source));
+                auto error_line = toll_charging::add_entry(merged, vehicle, road, distance, line_desc);
+                if (error_line)
+                    errors.emplace_back(line_no, std::get<input::line_error_desc_t>(error_line.value()));
+            }
+        }
+
+        // Leaves line_no at the number of lines of all files. Fails when a file cannot be read.
+        bool ingest_all(const std::vector<const char *> &paths, toll_charging::state_t &merged,
+                        input::line_no_t &line_no) {
+            std::vector<std::tuple<std::string_view, input::line_no_t>> files;
+            std::vector<std::string_view> mapped;
+            std::deque<std::string> inflated;
+            auto unmap = [&mapped]() {
+                for (auto bytes : mapped)
+                    munmap(const_cast<char *>(bytes.data()), bytes.size());
+            };
+            for (auto path : paths) {
+                auto bytes = read_file(path, mapped, inflated);
+                if (!bytes) {
+                    unmap();
+                    return false;
+                }
+                files.emplace_back(bytes.value(), line_no + 1);
+                line_no += count_lines(bytes.value());
+                stats::add(stats::counters.bytes_read, bytes.value().size());
+            }
+
+            pipeline::shards_t states(files.size());
+            std::vector<std::vector<pipeline::shard_error_t>> file_errors(files.size());
+            std::vector<stats::counters_t> file_counters(files.size());
+            pipeline::workers_t workers(files.size());
+            workers.run([&](size_t index) {
+                const auto &[bytes, first_line_no] = files[index];
+                ingest(bytes, first_line_no, states[index], file_errors[index], file_counters[index]);
+            });
+
+            std::vector<pipeline::shard_error_t> errors;
+            for (size_t index = 0; index < files.size(); index++) {
+                errors.insert(errors.end(), file_errors[index].begin(), file_errors[index].end());
+                const auto &counters = file_counters[index];
+                stats::add(stats::counters.lines, counters.lines);
+                stats::add(stats::counters.info_lines, counters.info_lines);
+                stats::add(stats::counters.empty_lines, counters.empty_lines);
+                stats::add(stats::counters.invalid_lines, counters.invalid_lines);
+            }
+            merge(states, merged, errors);
+            std::stable_sort(errors.begin(), errors.end(), [](const auto &lhs, const auto &rhs) {
+                return std::get<input::line_no_t>(lhs) < std::get<input::line_no_t>(rhs);
+            });
+            for (const auto &error : errors)
+                input::print_error(std::get<input::line_error_desc_t>(error));
+
+            // Nothing refers to the files any more, pending lines were copied into the merged state.
+            unmap();
+            return true;
+        }
+    }
+
+    // Long running mode: info lines arrive on ingest connections and commands on query connections, over TCP
+    // or Unix sockets, all handled by one epoll loop. Ingest lines are numbered in order of arrival and their
+    // errors go to stderr. Every query connection numbers its own lines and gets its answers and errors
+    // back. A query sees exactly the lines handled before it, and is answered without waiting for the peer,
+    // so a slow reader does not hold up ingest. SIGINT or SIGTERM stop the loop.
+    namespace server {
+        constexpr size_t max_events = 64;
+        constexpr size_t receive_chunk_size = 1 << 16;
+
+        enum class role_t : uint8_t {
+            ingest, query
+        };
+
+        struct connection_t {
+            int fd = -1;
+            role_t role = role_t::ingest;
+            // Bytes of the line that is not complete yet, and answers not sent yet.
+            std::string received, unsent;
+            input::line_no_t line_no = 0;
+            // Tells this connection apart from earlier ones with the same fd.
+            uint64_t serial = 0;
+            // The peer has finished sending, the connection is closed once everything is sent.
+            bool closing = false;
+            // A full dump is being printed for this connection. Its later lines wait until it is done.
+            bool dumping = false;
+        };
+
+        // Prints full dumps from snapshots on its own thread, so the loop goes on handling lines meanwhile.
+        // Every dump asked for at the same ingest line is the same: such requests join the queued or printing
+        // dump of that line, and the last printed dump answers them right away, so each line is copied and
+        // printed at most once. Every finished dump is announced on an eventfd.
+        class dumper_t {
+        public:
+            // Fd and serial number of a connection waiting for a dump.
+            using waiter_t = std::tuple<int, uint64_t>;
+            using dump_t = std::shared_ptr<const std::string>;
+            // Ingest line number of the snapshot, the snapshot, and the connections waiting for its dump.
+            using job_t = std::tuple<input::line_no_t, toll_charging::snapshot_t, std::vector<waiter_t>>;
+            using result_t = std::tuple<input::line_no_t, std::vector<waiter_t>, dump_t>;
+
+            dumper_t() : event_fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)), thread([this]() { loop(); }) {
+            }
+
+            ~dumper_t() {
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    stopping = true;
+                }
+                wakeup.notify_one();
+                thread.join();
+                close(event_fd);
+            }
+
+            int fd() const {
+                return event_fd;
+            }
+
+            // The dump of the state as of ingest line line_no when it is printed already. Otherwise the
+            // connection gets it among the results later, and nothing is returned.
+            dump_t request(toll_charging::state_t &state, input::line_no_t line_no, int fd, uint64_t serial) {
+                if (std::get<dump_t>(last_dump) && std::get<input::line_no_t>(last_dump) == line_no)
+                    return std::get<dump_t>(last_dump);
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (!jobs.empty() && std::get<input::line_no_t>(jobs.back()) == line_no) {
+                        std::get<std::vector<waiter_t>>(jobs.back()).emplace_back(fd, serial);
+                        return nullptr;
+                    }
+                }
+                // Taken outside of the lock, the state only changes on this thread.
+                auto snapshot = toll_charging::take_snapshot(state);
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    jobs.emplace_back(line_no, std::move(snapshot), std::vector<waiter_t>{waiter_t(fd, serial)});
+                }
+                wakeup.notify_one();
+                return nullptr;
+            }
+
+            // Dumps finished since the previous call, in the order they were requested.
+            std::vector<result_t> take_results() {
+                uint64_t count;
+                if (read(event_fd, &count, sizeof(count)) < 0)
+                    return {};
+                std::vector<result_t> finished;
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    finished = std::exchange(results, {});
+                }
+                if (!finished.empty())
+                    last_dump = std::make_tuple(std::get<input::line_no_t>(finished.back()),
+                                                std::get<dump_t>(finished.back()));
+                return finished;
+            }
+
+        private:
+            void loop() {
+                std::unique_lock<std::mutex> lock(mutex);
+                while (true) {
+                    wakeup.wait(lock, [this]() { return stopping || !jobs.empty(); });
+                    if (stopping)
+                        return;
+                    // Stays queued while printing, so more connections can join it. References to deque elements
+                    // survive jobs added at the back.
+                    auto &[line_no, snapshot, waiters] = jobs.front();
+                    lock.unlock();
+                    auto dump = std::make_shared<std::string>();
+                    output::captured = dump.get();
+                    input::print_snapshot(snapshot);
+                    output::captured = nullptr;
+                    lock.lock();
+                    results.emplace_back(line_no, std::move(waiters), std::move(dump));
+                    jobs.pop_front();
+                    uint64_t one = 1;
+                    [[maybe_unused]] auto written = write(event_fd, &one, sizeof(one));
+                }
+            }
+
+            int event_fd;
+            std::mutex mutex;
+            std::condition_variable wakeup;
+            std::deque<job_t> jobs;
+            std::vector<result_t> results;
+            bool stopping = false;
+            // Only used by the thread of the loop.
+            std::tuple<input::line_no_t, dump_t> last_dump;
+            // After event_fd and the queues, which loop uses from its first iteration.
+            std::thread thread;
+        };
+
+        // Path of the socket file of a unix: address, empty for tcp: ones.
+        std::string socket_path(std::string_view address) {
+            return std::string(address.substr(0, 5) == "unix:" ? address.substr(5) : std::string_view());
+        }
+
+        // ADDRESS is unix:PATH, tcp:PORT on the loopback interface, or tcp:HOST:PORT with an IPv4 HOST. A
+        // socket left at PATH by an earlier run is replaced, any other file there is left alone and fails.
+        std::optional<int> listen_on(std::string_view address) {
+            int fd = -1;
+            if (address.substr(0, 5) == "unix:") {
+                auto path = socket_path(address);
+                sockaddr_un socket_address{};
+                if (path.empty() || path.size() >= sizeof(socket_address.sun_path))
+                    return std::nullopt;
+                socket_address.sun_family = AF_UNIX;
+                std::copy(path.begin(), path.end(), socket_address.sun_path);
+                struct stat path_stat;
+                if (lstat(path.c_str(), &path_stat) == 0) {
+                    if (!S_ISSOCK(path_stat.st_mode))
+                        return std::nullopt;
+                    unlink(path.c_str());
+                }
+                fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+                if (fd >= 0 && bind(fd, reinterpret_cast<sockaddr *>(&socket_address), sizeof(socket_address)) < 0) {
+                    close(fd);
+                    return std::nullopt;
+                }
+            } else if (address.substr(0, 4) == "tcp:") {
+                auto host_port = address.substr(4);
+                auto colon = host_port.rfind(':');
+                std::string host(colon == std::string_view::npos ? "127.0.0.1" : host_port.substr(0, colon));
+                auto port_str = colon == std::string_view::npos ? host_port : host_port.substr(colon + 1);
+                uint16_t port = 0;
+                auto [end, error] = std::from_chars(port_str.data(), port_str.data() + port_str.size(), port);
+                sockaddr_in socket_address{};
+                socket_address.sin_family = AF_INET;
+                socket_address.sin_port = htons(port);
+                if (port_str.empty() || error != std::errc() || end != port_str.data() + port_str.size()
+                    || inet_pton(AF_INET, host.c_str(), &socket_address.sin_addr) != 1)
+                    return std::nullopt;
+                fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+                int reuse = 1;
+                if (fd >= 0 && setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0) {
+                    close(fd);
+                    return std::nullopt;
+                }
+                if (fd >= 0 && bind(fd, reinterpret_cast<sockaddr *>(&socket_address), sizeof(socket_address)) < 0) {
+                    close(fd);
+                    return std::nullopt;
+                }
+            }
+            if (fd < 0 || listen(fd, SOMAXCONN) < 0) {
+                if (fd >= 0)
+                    close(fd);
+                return std::nullopt;
+            }
+            return fd;
+        }
+
+        bool watch(int epoll_fd, int op, int fd, uint32_t events) {
+            epoll_event event{};
+            event.events = events;
+            event.data.fd = fd;
+            return epoll_ctl(epoll_fd, op, fd, &event) == 0;
+        }
+
+        // Commands are only taken on query connections, on ingest ones they are invalid lines.
+        void handle_ingest_line(toll_charging::state_t &state, const input::line_desc_ref_t &line_desc) {
+            stats::add(stats::counters.lines, 1);
+            auto line = std::get<std::string_view>(line_desc);
+            input::dispatch(input::state_handlers_t{state}, line_desc,
+                            input::is_command_line(line) ? input::invalid_line_t() : input::parse_line(line));
+        }
+
+        // A full dump is handed to the dumper with the state as of ingest line line_no.
+        struct query_handlers_t : input::state_handlers_t {
+            input::line_no_t line_no;
+            dumper_t &dumper;
+            connection_t &connection;
+
+            using input::state_handlers_t::command;
+
+            void command(const input::command_desc_t &command) {
+                if (std::get<0>(command) || std::get<1>(command)) {
+                    input::state_handlers_t::command(command);
+                    return;
+                }
+                stats::timer_t timer(stats::counters.command_ns);
+                if (auto dump = dumper.request(state, line_no, connection.fd, connection.serial))
+                    connection.unsent += *dump;
+                else
+                    connection.dumping = true;
+                toll_charging::end_epoch(state.road_window);
+            }
+        };
+
+        // Info lines are only taken on ingest connections. Everything printed goes to the unsent answers of the
+        // connection.
+        void handle_query_line(toll_charging::state_t &state, input::line_no_t line_no, dumper_t &dumper,
+                               connection_t &connection, std::string_view line) {
+            stats::add(stats::counters.lines, 1);
+            auto parsed_line = input::parse_line(line);
+            if (std::holds_alternative<input::info_desc_t>(parsed_line))
+                parsed_line = input::invalid_line_t();
+            input::dispatch(query_handlers_t{{state}, line_no, dumper, connection},
+                            input::line_desc_ref_t(++connection.line_no, line), parsed_line, &connection.unsent);
+        }
+
+        // Handles the complete received lines, the first scanned bytes of which are known to hold no '\n'.
+        // A last line without '\n' is handled once the peer finishes sending. Stops at a full dump.
+        void handle_received(toll_charging::state_t &state, input::line_no_t &line_no, dumper_t &dumper,
+                             connection_t &connection, size_t scanned) {
+            auto &received = connection.received;
+            const char *begin = received.data(), *end = received.data() + received.size();
+            for (auto line_end = scanner::find_newline(begin + scanned, end);
+                 !connection.dumping && (line_end != end || (connection.closing && begin != end));
+                 line_end = scanner::find_newline(begin, end)) {
+                std::string_view line(begin, line_end - begin);
+                if (connection.role == role_t::ingest)
+                    handle_ingest_line(state, input::line_desc_ref_t(++line_no, line));
+                else
+                    handle_query_line(state, line_no, dumper, connection, line);
+                begin = line_end == end ? end : line_end + 1;
+            }
+            received.erase(0, begin - received.data());
+        }
+
+        // Reads whatever is available and handles it, until the peer finishes sending or a full dump starts.
+        void receive(toll_charging::state_t &state, input::line_no_t &line_no, dumper_t &dumper,
+                     connection_t &connection) {
+            auto &received = connection.received;
+            while (!connection.closing && !connection.dumping) {
+                auto filled = received.size();
+                received.resize(filled + receive_chunk_size);
+                ssize_t count = read(connection.fd, received.data() + filled, receive_chunk_size);
+                received.resize(filled + std::max<ssize_t>(count, 0));
+                if (count < 0 && errno == EINTR)
                     continue;
-                print_error(line_desc);
+                if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                    break;
+                if (count <= 0)
+                    connection.closing = true;
+                stats::add(stats::counters.bytes_read, std::max<ssize_t>(count, 0));
+                handle_received(state, line_no, dumper, connection, filled);
+            }
+        }
+
+        // Returns false when the connection is broken.
+        bool send_unsent(connection_t &connection) {
+            size_t sent = 0;
+            while (sent < connection.unsent.size()) {
+                ssize_t count = send(connection.fd, connection.unsent.data() + sent, connection.unsent.size() - sent,
+                                     MSG_NOSIGNAL);
+                if (count < 0 && errno == EINTR)
+                    continue;
+                if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                    break;
+                if (count <= 0)
+                    return false;
+                sent += count;
+            }
+            stats::add(stats::counters.bytes_written, sent);
+            connection.unsent.erase(0, sent);
+            return true;
+        }
+
+        // Handles connections until a stop signal arrives. Lines are numbered from line_no + 1, and line_no
+        // is left at the number of the last ingest line. Fails when an address cannot be listened on, or the
+        // loop cannot be set up. The socket files of unix: addresses are removed again at the end.
+        bool serve(toll_charging::state_t &state, input::line_no_t &line_no, const char *ingest_address,
+                   const char *query_address) {
+            // Fd, role and socket path of every listener.
+            std::vector<std::tuple<int, role_t, std::string>> listeners;
+            auto close_listeners = [&listeners]() {
+                for (const auto &[fd, role, path] : listeners) {
+                    close(fd);
+                    if (!path.empty())
+                        unlink(path.c_str());
+                }
+            };
+            for (auto [address, role] : {std::make_tuple(ingest_address, role_t::ingest),
+                                         std::make_tuple(query_address, role_t::query)}) {
+                if (!address)
+                    continue;
+                auto fd = listen_on(address);
+                if (!fd) {
+                    output::err << "Cannot listen on: " << std::string_view(address) << '\n';
+                    close_listeners();
+                    return false;
+                }
+                listeners.emplace_back(fd.value(), role, socket_path(address));
+            }
+
+            sigset_t stop_signals;
+            sigemptyset(&stop_signals);
+            sigaddset(&stop_signals, SIGINT);
+            sigaddset(&stop_signals, SIGTERM);
+            sigprocmask(SIG_BLOCK, &stop_signals, nullptr);
+            int signal_fd = signalfd(-1, &stop_signals, SFD_CLOEXEC);
+            // Started with the stop signals blocked, so they are never delivered to its thread.
+            dumper_t dumper;
+            int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+            bool watching = signal_fd >= 0 && dumper.fd() >= 0 && epoll_fd >= 0
+                            && watch(epoll_fd, EPOLL_CTL_ADD, signal_fd, EPOLLIN)
+                            && watch(epoll_fd, EPOLL_CTL_ADD, dumper.fd(), EPOLLIN);
+            for (const auto &[fd, role, path] : listeners)
+                watching = watching && watch(epoll_fd, EPOLL_CTL_ADD, fd, EPOLLIN);
+            if (!watching) {
+                output::err << "Cannot set up the server loop: " << std::strerror(errno) << '\n';
+                close_listeners();
+                if (epoll_fd >= 0)
+                    close(epoll_fd);
+                if (signal_fd >= 0)
+                    close(signal_fd);
+                sigprocmask(SIG_UNBLOCK, &stop_signals, nullptr);
+                return false;
+            }
+
+            // Indexed by fd.
+            std::vector<std::optional<connection_t>> connections;
+            uint64_t last_serial = 0;
+            auto close_connection = [&](connection_t &connection) {
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, connection.fd, nullptr);
+                close(connection.fd);
+                connections[connection.fd].reset();
+            };
+            // Sends what it can, and closes the connection once it is broken or done.
+            auto update_connection = [&](connection_t &connection) {
+                if (!send_unsent(connection)
+                    || (connection.closing && !connection.dumping && connection.unsent.empty())
+                    || !watch(epoll_fd, EPOLL_CTL_MOD, connection.fd,
+                              (connection.closing || connection.dumping ? 0u : uint32_t(EPOLLIN))
+                              | (connection.unsent.empty() ? 0u : uint32_t(EPOLLOUT))))
+                    close_connection(connection);
+            };
+
+            std::array<epoll_event, max_events> events;
+            for (bool running = true; running;) {
+                int count = epoll_wait(epoll_fd, events.data(), events.size(), -1);
+                if (count < 0 && errno != EINTR)
+                    break;
+                for (int index = 0; index < count; index++) {
+                    int fd = events[index].data.fd;
+                    auto listener = std::find_if(listeners.begin(), listeners.end(), [fd](const auto &listener) {
+                        return std::get<int>(listener) == fd;
+                    });
+                    if (fd == signal_fd) {
+                        // Consumed, so it is not delivered once unblocked again.
+                        signalfd_siginfo info;
+                        running = read(signal_fd, &info, sizeof(info)) < 0;
+                    } else if (fd == dumper.fd()) {
+                        // Answers of the connection go on with the lines after the dump.
+                        for (auto &[dump_line_no, waiters, dump] : dumper.take_results())
+                            for (auto [dump_fd, serial] : waiters) {
+                                if (size_t(dump_fd) >= connections.size() || !connections[dump_fd]
+                                    || connections[dump_fd]->serial != serial)
+                                    continue;
+                                auto &connection = connections[dump_fd].value();
+                                connection.unsent += *dump;
+                                connection.dumping = false;
+                                handle_received(state, line_no, dumper, connection, 0);
+                                if (!connection.dumping)
+                                    receive(state, line_no, dumper, connection);
+                                update_connection(connection);
+                            }
+                    } else if (listener != listeners.end()) {
+                        for (int client_fd; (client_fd = accept4(fd, nullptr, nullptr,
+                                                                 SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0;) {
+                            if (!watch(epoll_fd, EPOLL_CTL_ADD, client_fd, EPOLLIN)) {
+                                close(client_fd);
+                                continue;
+                            }
+                            if (connections.size() <= size_t(client_fd))
+                                connections.resize(client_fd + 1);
+                            connections[client_fd].emplace();
+                            connections[client_fd]->fd = client_fd;
+                            connections[client_fd]->role = std::get<role_t>(*listener);
+                            connections[client_fd]->serial = ++last_serial;
+                        }
+                    } else if (size_t(fd) < connections.size() && connections[fd]) {
+                        auto &connection = connections[fd].value();
+                        auto hung_up = events[index].events & (EPOLLHUP | EPOLLERR);
+                        // Hang ups are reported even when not asked for, and the peer cannot take the dump.
+                        if (connection.dumping && hung_up)
+                            close_connection(connection);
+                        else {
+                            if ((events[index].events & EPOLLIN) || hung_up)
+                                receive(state, line_no, dumper, connection);
+                            update_connection(connection);
+                        }
+                    }
+                }
+                output::flush();
+            }
+
+            for (auto &connection : connections)
+                if (connection)
+                    close(connection->fd);
+            close_listeners();
+            close(epoll_fd);
+            close(signal_fd);
+            sigprocmask(SIG_UNBLOCK, &stop_signals, nullptr);
+            if (options::stats_at_exit)
+                input::print_stats(state);
+            return true;
+        }
+    }
+
+    // Binary image of toll_charging::state_t, together with the number of lines read so far, so processing
+    // can continue after a restart without replaying the input. Values are stored in host byte order:
+    //   magic, line number,
+    //   plate numbers in id order,
+    //   per vehicle: mask of present road types, 64-bit A and S totals,
+    //   64-bit road totals and presence flags in road::road_index order,
+    //   road window: epoch, number of buckets, per bucket the number of traveled roads, then the road index
+    //   and 64-bit total of each,
+    //   vehicle ids in plate number order,
+    //   pending entries: vehicle id, road, start distance, line number and the original line bytes.
+    namespace checkpoint {
+        // Version 2 widened the vehicle and road totals to 64 bits, version 3 added the road window.
+        constexpr std::string_view magic = "NODSTAT3";
+
+        template<typename T>
+        void put(std::string &out, const T &value) {
+            out.append(reinterpret_cast<const char *>(&value), sizeof(value));
+        }
+
+        template<typename T>
+        bool get(std::string_view &in, T &value) {
+            if (in.size() < sizeof(value))
+                return false;
+            std::memcpy(&value, in.data(), sizeof(value));
+            in.remove_prefix(sizeof(value));
+            return true;
+        }
+
+        bool save(toll_charging::state_t &state, input::line_no_t line_no, const char *path) {
+            const auto &sorted = toll_charging::sorted_vehicles(state);
+            const auto &table = state.table;
+            const auto &vehicles_data = state.vehicles_data;
+            const auto &roads_data = state.roads_data;
+            const auto &not_finished = state.not_finished;
+            const auto &plates = std::get<vehicle::plates_t>(table);
+            std::string out(magic);
+            put(out, line_no);
+
+            put(out, uint32_t(plates.size()));
+            for (const auto &plate_no : plates)
+                put(out, plate_no);
+
+            put(out, uint32_t(vehicles_data.size()));
+            for (const auto &[distances, mask] : vehicles_data) {
+                put(out, mask);
+                for (auto distance : distances)
+                    put(out, distance);
+            }
+
+            const auto &[distances, present] = roads_data;
+            for (size_t index = 0; index < road::road_slots; index++) {
+                put(out, distances[index]);
+                put(out, uint8_t(present.test(index)));
+            }
+
+            const auto &[buckets, epoch] = state.road_window;
+            put(out, epoch);
+            put(out, uint32_t(buckets.size()));
+            for (const auto &bucket : buckets) {
+                put(out, uint32_t(std::get<1>(bucket).count()));
+                toll_charging::for_each_road(bucket, [&out](const road::road_t &road, road::total_distance_t distance) {
+                    put(out, uint16_t(road::road_index(road)));
+                    put(out, distance);
+                });
+            }
+
+            put(out, uint32_t(sorted.size()));
+            for (auto id : sorted)
+                put(out, id);
+
+            put(out, uint32_t(std::get<size_t>(not_finished)));
+            for (const auto &[id, entry] : std::get<std::vector<toll_charging::not_finished_slot_t>>(not_finished)) {
+                if (id == toll_charging::no_vehicle)
+                    continue;
+                const auto &[road, distance, source] = entry;
+                auto [entry_line_no, line] = toll_charging::load_line(state, std::get<input::stored_line_t>(source));
+                put(out, id);
+                put(out, std::get<road::road_num_t>(road));
+                put(out, std::get<road::road_type_t>(road));
+                put(out, distance);
+                put(out, entry_line_no);
+                put(out, uint32_t(line.size()));
+                out.append(line);
+            }
+            return output::write_file(path, out);
+        }
+
+        bool load(std::string_view in, toll_charging::state_t &state, input::line_no_t &line_no) {
+            auto &table = state.table;
+            auto &vehicles_data = state.vehicles_data;
+            auto &roads_data = state.roads_data;
+            auto &not_finished = state.not_finished;
+            auto &order = state.vehicles_order;
+            if (in.substr(0, magic.size()) != magic)
+                return false;
+            in.remove_prefix(magic.size());
+            if (!get(in, line_no))
+                return false;
+
+            uint32_t count;
+            if (!get(in, count))
+                return false;
+            for (uint32_t id = 0; id < count; id++) {
+                vehicle::plate_no_t plate_no;
+                if (!get(in, plate_no))
+                    return false;
+                if (vehicle::intern(table, vehicle::vehicle_ref_t(vehicle::plate_no_view(plate_no))) != id)
+                    return false;
+            }
+            auto plates_count = count;
+
+            if (!get(in, count) || count > plates_count)
+                return false;
+            vehicles_data.resize(count);
+            for (auto &[distances, mask] : vehicles_data) {
+                if (!get(in, mask) || mask >> road::road_types.size())
+                    return false;
+                for (size_t index = 0; index < distances.size(); index++)
+                    if (!get(in, distances[index]) || (!(mask & (1 << index)) && distances[index] != 0))
+                        return false;
+            }
+
+            auto &[distances, present] = roads_data;
+            for (size_t index = 0; index < road::road_slots; index++) {
+                uint8_t flag;
+                if (!get(in, distances[index]) || !get(in, flag))
+                    return false;
+                present.set(index, flag);
+            }
+
+            auto &[buckets, epoch] = state.road_window;
+            if (!get(in, epoch) || !get(in, count) || (count != 0 && count != toll_charging::max_window))
+                return false;
+            buckets.resize(count);
+            for (auto &bucket : buckets) {
+                uint32_t roads;
+                if (!get(in, roads))
+                    return false;
+                for (uint32_t road = 0; road < roads; road++) {
+                    uint16_t index;
+                    road::total_distance_t distance;
+                    if (!get(in, index) || !get(in, distance) || index >= road::road_slots)
+                        return false;
+                    toll_charging::add_road_distance(bucket, road::road_at(index), distance);
+                }
+            }
+
+            // Exactly the vehicles with a finished trip, each once and in plate number order.
+            auto &sorted = order.sorted;
+            if (!get(in, count)
+                || count != size_t(std::count_if(vehicles_data.begin(), vehicles_data.end(), toll_charging::has_trips)))
+                return false;
+            sorted.resize(count);
+            for (size_t index = 0; index < sorted.size(); index++) {
+                auto &id = sorted[index];
+                if (!get(in, id) || id >= vehicles_data.size() || !toll_charging::has_trips(vehicles_data[id]))
+                    return false;
+                if (index > 0 && !(vehicle::plate_no(table, sorted[index - 1]) < vehicle::plate_no(table, id)))
+                    return false;
+            }
+
+            if (!get(in, count))
+                return false;
+            for (uint32_t entry = 0; entry < count; entry++) {
+                vehicle::vehicle_id_t id;
+                road::road_num_t road_num;
+                road::road_type_t road_type;
+                road::distance_t distance;
+                input::line_no_t entry_line_no;
+                uint32_t length;
+                if (!get(in, id) || !get(in, road_num) || !get(in, road_type) || !get(in, distance)
+                    || !get(in, entry_line_no) || !get(in, length) || in.size() < length || id >= plates_count)
+                    return false;
+                if (!scanner::is<scanner::road_type_class>(road_type) || road_num < 1 || road_num > road::max_road_num
+                    || distance < 0)
+                    return false;
+                toll_charging::reserve_slot(not_finished);
+                auto &[slot_id, slot_entry] = std::get<std::vector<toll_charging::not_finished_slot_t>>(
+                        not_finished)[toll_charging::probe(not_finished, id)];
+                if (slot_id == id)
+                    return false;
+                slot_id = id;
+                auto stored_line = toll_charging::store_line(
+                        state, input::line_desc_ref_t(entry_line_no, in.substr(0, length)));
+                slot_entry = toll_charging::not_finished_entry_t(road::road_t(road_num, road_type), distance,
+                                                                 stored_line);
+                std::get<size_t>(not_finished)++;
+                in.remove_prefix(length);
+            }
+            toll_charging::rebuild_top(state);
+            return in.empty();
+        }
+
+        // The file is mapped into memory and decoded in place. Reports a file that cannot be read or that is not
+        // a consistent checkpoint.
+        bool restore(toll_charging::state_t &state, input::line_no_t &line_no, const char *path) {
+            int fd = open(path, O_RDONLY);
+            struct stat file_stat{};
+            void *data = MAP_FAILED;
+            if (fd >= 0 && fstat(fd, &file_stat) == 0 && file_stat.st_size > 0)
+                data = mmap(nullptr, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (fd >= 0)
+                close(fd);
+            if (data == MAP_FAILED) {
+                output::err << "Cannot restore checkpoint: " << std::string_view(path) << '\n';
+                return false;
             }
+            bool loaded = load(std::string_view(static_cast<const char *>(data), file_stat.st_size), state, line_no);
+            munmap(data, file_stat.st_size);
+            if (!loaded)
+                output::err << "Corrupt checkpoint: " << std::string_view(path) << '\n';
+            return loaded;
         }
     }
+
+    // Totals of a state as columns, for readers that map the file instead of parsing the output of "?".
+    // Vehicles are in plate number order and roads in output order. Values are stored in host byte order,
+    // and every column starts at a multiple of 8 bytes:
+    //   magic, 64-bit vehicle count, 64-bit road count,
+    //   plate numbers, 16 zero padded bytes each,
+    //   one column of 64-bit totals per road type in road::road_types order, 0 without a finished trip,
+    //   masks of the road types with a finished trip, one byte each,
+    //   road::road_types as the dictionary of road types, padded to 8 bytes,
+    //   64-bit road totals,
+    //   16-bit road ids, the road number times the dictionary size plus the index of the road type.
+    // Totals are in tenths of km.
+    namespace columns {
+        constexpr std::string_view magic = "NODCOLS1";
+
+        void pad(std::string &out) {
+            out.resize((out.size() + 7) / 8 * 8, '\0');
+        }
+
+        bool save(toll_charging::state_t &state, const char *path) {
+            const auto &sorted = toll_charging::sorted_vehicles(state);
+            const auto &plates = std::get<vehicle::plates_t>(state.table);
+            const auto &vehicles_data = state.vehicles_data;
+            const auto &[road_distances, present] = state.roads_data;
+            std::string out(magic);
+            out.reserve(magic.size() + 16 + sorted.size() * 40 + present.count() * 10 + 16);
+            checkpoint::put(out, uint64_t(sorted.size()));
+            checkpoint::put(out, uint64_t(present.count()));
+
+            for (auto id : sorted)
+                checkpoint::put(out, plates[id]);
+            for (size_t index = 0; index < road::road_types.size(); index++)
+                for (auto id : sorted)
+                    checkpoint::put(out, std::get<0>(vehicles_data[id])[index]);
+            for (auto id : sorted)
+                checkpoint::put(out, std::get<uint8_t>(vehicles_data[id]));
+            pad(out);
+
+            out.append(road::road_types.begin(), road::road_types.end());
+            pad(out);
+            for (size_t index = 0; index < road::road_slots; index++)
+                if (present.test(index))
+                    checkpoint::put(out, road_distances[index]);
+            for (size_t index = 0; index < road::road_slots; index++)
+                if (present.test(index))
+                    checkpoint::put(out, uint16_t(index));
+            pad(out);
+            return output::write_file(path, out);
+        }
+    }
+}
+
+#if defined(NOD_ALLOC_STATS)
+void *operator new(size_t size) {
+    return memory::checked(memory::counted_allocate(size));
+}
+
+void *operator new[](size_t size) {
+    return memory::checked(memory::counted_allocate(size));
+}
+
+void *operator new(size_t size, std::align_val_t alignment) {
+    return memory::checked(memory::counted_allocate(size, alignment));
+}
+
+void *operator new[](size_t size, std::align_val_t alignment) {
+    return memory::checked(memory::counted_allocate(size, alignment));
 }
 
+void *operator new(size_t size, const std::nothrow_t &) noexcept {
+    return memory::counted_allocate(size);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept {
+    return memory::counted_allocate(size);
+}
+
+void *operator new(size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept {
+    return memory::counted_allocate(size, alignment);
+}
+
+void *operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept {
+    return memory::counted_allocate(size, alignment);
+}
+
+// GCC does not recognize these as the replacements of the operator new forms above.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void operator delete(void *pointer) noexcept {
+    std::free(pointer);
+}
+
+void operator delete[](void *pointer) noexcept {
+    std::free(pointer);
+}
+
+void operator delete(void *pointer, size_t) noexcept {
+    std::free(pointer);
+}
+
+void operator delete[](void *pointer, size_t) noexcept {
+    std::free(pointer);
+}
 
-int main() {
-    input::handle_all();
+void operator delete(void *pointer, std::align_val_t) noexcept {
+    std::free(pointer);
+}
+
+void operator delete[](void *pointer, std::align_val_t) noexcept {
+    std::free(pointer);
+}
+
+void operator delete(void *pointer, size_t, std::align_val_t) noexcept {
+    std::free(pointer);
+}
+
+void operator delete[](void *pointer, size_t, std::align_val_t) noexcept {
+    std::free(pointer);
+}
+
+void operator delete(void *pointer, const std::nothrow_t &) noexcept {
+    std::free(pointer);
+}
+
+void operator delete[](void *pointer, const std::nothrow_t &) noexcept {
+    std::free(pointer);
+}
+
+void operator delete(void *pointer, std::align_val_t, const std::nothrow_t &) noexcept {
+    std::free(pointer);
+}
+
+void operator delete[](void *pointer, std::align_val_t, const std::nothrow_t &) noexcept {
+    std::free(pointer);
+}
+#pragma GCC diagnostic pop
+#endif
+
+// Left out by bench/nod_bench.cc, which includes this file and has a main of its own.
+#ifndef NOD_NO_MAIN
+int main(int argc, char *argv[]) {
+    size_t threads = 1;
+    const char *checkpoint_path = nullptr, *restore_path = nullptr, *export_path = nullptr;
+    std::vector<const char *> input_paths;
+    const char *ingest_address = nullptr, *query_address = nullptr;
+    bool alloc_stats = false;
+    auto print_alloc_stats = [&alloc_stats]() {
+        if (alloc_stats)
+            output::err << "Allocations: " << memory::allocations.load() << ", "
+                        << memory::allocated_bytes.load() << " bytes\n";
+        output::flush();
+    };
+    for (int i = 1; i < argc; i++) {
+        std::string_view arg(argv[i]);
+        if (arg == "--regex-reference")
+            options::regex_reference = true;
+        else if (arg == "--alloc-stats" && memory::counted)
+            alloc_stats = true;
+        else if (arg == "--stats" && stats::enabled)
+            options::stats_at_exit = true;
+        else if (arg == "--error-limit" && i + 1 < argc && options::parse_count(argv[i + 1]))
+            options::error_limit = options::parse_count(argv[++i]).value();
+        else if (arg == "--threads" && i + 1 < argc && std::atoi(argv[i + 1]) > 0)
+            threads = std::atoi(argv[++i]);
+        else if (arg == "--checkpoint" && i + 1 < argc)
+            checkpoint_path = argv[++i];
+        else if (arg == "--restore" && i + 1 < argc)
+            restore_path = argv[++i];
+        else if (arg == "--export" && i + 1 < argc)
+            export_path = argv[++i];
+        else if (arg == "--input" && i + 1 < argc)
+            input_paths.push_back(argv[++i]);
+        else if (arg == "--ingest" && i + 1 < argc)
+            ingest_address = argv[++i];
+        else if (arg == "--query" && i + 1 < argc)
+            query_address = argv[++i];
+        else {
+            output::err << "Unknown option: " << arg << '\n';
+            output::flush();
+            return 1;
+        }
+    }
+    if (threads > 1) {
+        if (checkpoint_path || restore_path || export_path || !input_paths.empty() || ingest_address
+            || query_address) {
+            output::err << "--threads cannot be combined with other input or state options\n";
+            output::flush();
+            return 1;
+        }
+        bool read = pipeline::handle_all(threads);
+        input::print_suppressed_errors();
+        print_alloc_stats();
+        return read ? 0 : 1;
+    }
+
+    if (restore_path && !input_paths.empty()) {
+        output::err << "--restore cannot be combined with --input\n";
+        output::flush();
+        return 1;
+    }
+
+    toll_charging::state_t state;
+    input::line_no_t line_no = 0;
+    if (!input_paths.empty() && !regions::ingest_all(input_paths, state, line_no)) {
+        output::flush();
+        return 1;
+    }
+    if (restore_path && !checkpoint::restore(state, line_no, restore_path)) {
+        output::flush();
+        return 1;
+    }
+    if (ingest_address || query_address) {
+        if (!server::serve(state, line_no, ingest_address, query_address)) {
+            output::flush();
+            return 1;
+        }
+    } else if (!input::handle_all(state, line_no)) {
+        input::print_suppressed_errors();
+        output::flush();
+        return 1;
+    }
+    input::print_suppressed_errors();
+    output::flush();
+    if (checkpoint_path && !checkpoint::save(state, line_no, checkpoint_path)) {
+        output::err << "Cannot write checkpoint: " << std::string_view(checkpoint_path) << '\n';
+        output::flush();
+        return 1;
+    }
+    if (export_path && !columns::save(state, export_path)) {
+        output::err << "Cannot write export: " << std::string_view(export_path) << '\n';
+        output::flush();
+        return 1;
+    }
+    print_alloc_stats();
     return 0;
-}
\ No newline at end of file
+}
+#endif
@@ -0,0 +1,74 @@
+#ifndef NOD_H
+#define NOD_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+// The toll charging engine of nod.cc as a library, for programs that have their traffic as typed events rather
+// than text lines. It keeps the same totals and pairs entries with exits by the same rules, without parsing.
+// Distances are in tenths of km, as in the input. Build and link the nod_engine library of CMakeLists.txt, as
+// examples/engine_example.cc does.
+namespace nod {
+    // Road type 'A' (motorway) or 'S' (expressway), and a number from 1 to 999.
+    struct Road {
+        char type;
+        int num;
+    };
+
+    // A vehicle passing a junction of a road. The plate number is 3 to 11 letters and digits, and is only read
+    // during ingest.
+    struct Event {
+        std::string_view plate_no;
+        Road road;
+        int distance;
+    };
+
+    // An event that did not add to the totals: invalid right away, or unpaired when the vehicle passed a junction
+    // of another road before the exit. These are the error reports of nod.cc. Events are numbered from 1 in the
+    // order they were ingested, across all calls.
+    struct Rejection {
+        enum class Reason { invalid, unpaired };
+
+        uint64_t event;
+        Reason reason;
+    };
+
+    // Totals of a vehicle, for the road types it has finished trips on.
+    struct VehicleTotals {
+        std::optional<int64_t> motorway, expressway;
+    };
+
+    // Engines share no state, so each can be used by a thread of its own. Queries may run concurrently with each
+    // other, but not with ingest.
+    class TollEngine {
+    public:
+        TollEngine();
+        ~TollEngine();
+        TollEngine(TollEngine &&other) noexcept;
+        TollEngine &operator=(TollEngine &&other) noexcept;
+
+        // Applies the events in order, and returns the rejections in the order they were found.
+        std::vector<Rejection> ingest(const Event *events, size_t count);
+        std::vector<Rejection> ingest(const std::vector<Event> &events);
+
+        // Nothing for vehicles without a finished trip and roads nobody traveled, as the ? command prints.
+        std::optional<VehicleTotals> query_vehicle(std::string_view plate_no) const;
+        std::optional<int64_t> query_road(Road road) const;
+        std::vector<std::optional<VehicleTotals>> query_vehicles(const std::string_view *plate_nos,
+                                                                 size_t count) const;
+        std::vector<std::optional<int64_t>> query_roads(const Road *roads, size_t count) const;
+
+        // Number of events ingested so far, the number of the last one.
+        uint64_t events() const;
+
+    private:
+        struct State;
+        std::unique_ptr<State> state;
+    };
+}
+
+#endif
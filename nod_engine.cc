@@ -0,0 +1,108 @@
+// The TollEngine of nod.h on top of nod::detail::toll_charging::state_t of engine.h, which it shares with nod.cc.
+#include "nod.h"
+
+#include "engine.h"
+
+namespace {
+    namespace engine {
+        using namespace nod::detail;
+
+        std::optional<road::road_t> to_road(const nod::Road &road) {
+            if (!scanner::is<scanner::road_type_class>(road.type) || road.num < 1 || road.num > road::max_road_num)
+                return std::nullopt;
+            return road::road_t(road::road_num_t(road.num), road.type);
+        }
+
+        std::optional<nod::VehicleTotals> vehicle_totals(const toll_charging::state_t &state,
+                                                         std::string_view plate_no) {
+            if (!scanner::is_plate_no(plate_no))
+                return std::nullopt;
+            auto entries = toll_charging::find_vehicle_data(state, vehicle::vehicle_ref_t(plate_no));
+            if (!entries)
+                return std::nullopt;
+            const auto &[distances, mask] = *entries;
+            nod::VehicleTotals totals;
+            if (mask & (1 << road::type_index('A')))
+                totals.motorway = distances[road::type_index('A')];
+            if (mask & (1 << road::type_index('S')))
+                totals.expressway = distances[road::type_index('S')];
+            return totals;
+        }
+
+        std::optional<int64_t> road_total(const toll_charging::state_t &state, const nod::Road &road) {
+            auto road_desc = to_road(road);
+            if (!road_desc)
+                return std::nullopt;
+            const auto &roads_data = state.roads_data;
+            auto distance = toll_charging::find_road_data(roads_data, road_desc.value());
+            if (!distance)
+                return std::nullopt;
+            return *distance;
+        }
+    }
+}
+
+struct nod::TollEngine::State {
+    detail::toll_charging::state_t state;
+    uint64_t events = 0;
+};
+
+nod::TollEngine::TollEngine() : state(std::make_unique<State>()) {}
+
+nod::TollEngine::~TollEngine() = default;
+
+nod::TollEngine::TollEngine(TollEngine &&other) noexcept = default;
+
+nod::TollEngine &nod::TollEngine::operator=(TollEngine &&other) noexcept = default;
+
+std::vector<nod::Rejection> nod::TollEngine::ingest(const Event *events, size_t count) {
+    std::vector<Rejection> rejections;
+    for (const Event *event = events; event != events + count; event++) {
+        uint64_t number = ++state->events;
+        auto road = engine::to_road(event->road);
+        if (!road || !detail::scanner::is_plate_no(event->plate_no) || event->distance < 0) {
+            rejections.push_back(Rejection{number, Rejection::Reason::invalid});
+            continue;
+        }
+        auto rejected = detail::toll_charging::add_entry(state->state, detail::vehicle::vehicle_ref_t(event->plate_no),
+                                                         road.value(), detail::road::distance_t(event->distance),
+                                                         detail::toll_charging::event_no_t(number));
+        if (rejected)
+            rejections.push_back(Rejection{std::get<detail::toll_charging::event_no_t>(rejected.value()),
+                                           Rejection::Reason::unpaired});
+    }
+    return rejections;
+}
+
+std::vector<nod::Rejection> nod::TollEngine::ingest(const std::vector<Event> &events) {
+    return ingest(events.data(), events.size());
+}
+
+std::optional<nod::VehicleTotals> nod::TollEngine::query_vehicle(std::string_view plate_no) const {
+    return engine::vehicle_totals(state->state, plate_no);
+}
+
+std::optional<int64_t> nod::TollEngine::query_road(Road road) const {
+    return engine::road_total(state->state, road);
+}
+
+std::vector<std::optional<nod::VehicleTotals>> nod::TollEngine::query_vehicles(const std::string_view *plate_nos,
+                                                                               size_t count) const {
+    std::vector<std::optional<VehicleTotals>> result;
+    result.reserve(count);
+    for (size_t index = 0; index < count; index++)
+        result.push_back(engine::vehicle_totals(state->state, plate_nos[index]));
+    return result;
+}
+
+std::vector<std::optional<int64_t>> nod::TollEngine::query_roads(const Road *roads, size_t count) const {
+    std::vector<std::optional<int64_t>> result;
+    result.reserve(count);
+    for (size_t index = 0; index < count; index++)
+        result.push_back(engine::road_total(state->state, roads[index]));
+    return result;
+}
+
+uint64_t nod::TollEngine::events() const {
+    return state->events;
+}